@@ -29,7 +29,7 @@ function bold { echo -en "\033[1m"; }
 function thin { echo -en "\033[0m"; }
 function normal { tput sgr0; }
 
-debpkg="g++ binutils make subversion cmake pkg-config libfuse-dev fuse-utils libpcre++-dev unixodbc-dev libmysqlclient-dev libpq-dev libsqlite3-dev"
+debpkg="g++ binutils make subversion cmake pkg-config libfuse3-dev fuse3 libpcre++-dev unixodbc-dev libmysqlclient-dev libpq-dev libsqlite3-dev"
 
 function tstapt 
 {
@@ -64,19 +64,19 @@ function error { red; echo ""; echo -en ""; echo "error: $@"; normal; if [ "$dep
 function enable-later {  echo $@; }
 function check-lib { echo -e "$2 $3 $4 $5 $6 $7\nint main(){}" | g++ -o /dev/null -x c++ - -l$1 2>/dev/null; }
 function check-libstd { echo -e "#include<sstream>\nint main(){}" | g++ -o /dev/null -x c++ - 2>/dev/null; }
-function check-fuse { echo -e "#include<fuse.h>\nint main(){}" | g++ -D FUSE_USE_VERSION=25 -o /dev/null -x c++ - $(pkg-config --cflags --libs fuse) 2>/dev/null; }
+function check-fuse { echo -e "#include<fuse_lowlevel.h>\nint main(){}" | g++ -D FUSE_USE_VERSION=31 -o /dev/null -x c++ - $(pkg-config --cflags --libs fuse3) 2>/dev/null; }
 function check-libpq { echo -e "#ifdef __APPLE__\n#include <libpq-fe.h>\n#else\n#include <postgresql/libpq-fe.h>\n#endif\nint main(){}" | g++ -o /dev/null -x c++ - `pkg-config --cflags libpq 2>/dev/null` -lpq 2>/dev/null; }
 function check-libmysqlclient { echo -e "#ifdef __APPLE__\n#include <mysql.h>\n#else\n#include <mysql/mysql.h>\n#endif\nint main(){}" | g++ -o /dev/null -x c++ - `pkg-config --cflags mysqlclient 2>/dev/null` -lpq 2>/dev/null; }
 function check-bin { $@ >/dev/null 2>/dev/null; }
 
 function test-fuse
 {
-  bold; echo -n "Checking if library fuse is installed...  "; thin
+  bold; echo -n "Checking if library fuse3 is installed...  "; thin
   if check-fuse $@
   then
     ok
   else
-    error library \"fuse\" is not installed. Please install the development package of this library using your distribution\'s package manager.
+    error library \"fuse3\" is not installed. Please install the development package of this library using your distribution\'s package manager.
   fi
 }
 function test-lib-custom
@@ -138,12 +138,12 @@ function test-bin-fuse
     return 0
   fi
 
-  bold; echo -n "Checking if fuse-utils are installed...  "; thin
-  if check-bin fusermount -V
+  bold; echo -n "Checking if fuse3 utilities are installed...  "; thin
+  if check-bin fusermount3 -V
   then
     ok
   else
-    error "the package fuse-utils (fusermount) does not seem to be installed. Please install it using your distribution's package manager."
+    error "the package fuse3 (fusermount3) does not seem to be installed. Please install it using your distribution's package manager."
   fi
 }
 
@@ -0,0 +1,204 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include <stdexcept>
+#include "bulk.hpp"
+
+// Size of a block written to the loader file
+#define BULK_BLOCK_SIZE (1 << 20)
+
+// Append field i of a batch of rows in the loader format of the infile
+// strategy: tab separated, with \N for NULL and `\' escaping `\', tab,
+// new line and the zero byte. Every other byte is written as is.
+static void loader_field(const fmt_rows& rows, size_t i, std::string& out)
+{
+	if(rows.null(i)) { out += "\\N"; return; }
+
+	const char* s = rows.data.data() + rows.start(i);
+	size_t n = rows.size(i), span = 0;
+	for(size_t j = 0; j < n; j++) {
+		const char* e;
+		switch(s[j]) {
+		case '\\': e = "\\\\"; break;
+		case '\t': e = "\\t"; break;
+		case '\n': e = "\\n"; break;
+		case 0: e = "\\0"; break;
+		default: continue;
+		}
+		out.append(s + span, j - span);
+		out += e;
+		span = j + 1;
+	}
+	out.append(s + span, n - span);
+}
+
+// Write n bytes at s to fd. Throws on error.
+static void write_block(int fd, const std::string& s)
+{
+	size_t n = 0;
+	while(n < s.size()) {
+		ssize_t w = write(fd, s.data() + n, s.size() - n);
+		if(w < 0 && errno == EINTR) continue;
+		if(w <= 0) throw std::runtime_error(std::string("bulk_load write: ") + strerror(errno));
+		n += w;
+	}
+}
+
+// Convert rows of the file to the loader format in file descriptor fd.
+// Returns the number of rows.
+static size_t write_loader(row_stmts& rs, int fd, const char* fname, off_t from, off_t to)
+{
+	fmt_reader rd(fname, from, to);
+	fmt_rows rows;
+	std::string blk;
+	size_t count = 0;
+	while(rd.next(rows)) {
+		for(size_t r = 0; r < rows.rows.size(); r++) {
+			if(rows.fields(r) != rs.cols.size())
+				throw std::runtime_error("row does not match the table header: " + rs.tab);
+			size_t f = rows.rows[r].first;
+			for(size_t i = 0; i < rs.cols.size(); i++) {
+				if(i) blk += '\t';
+				loader_field(rows, f + i, blk);
+			}
+			blk += '\n';
+		}
+		count += rows.rows.size();
+		if(blk.size() >= BULK_BLOCK_SIZE) { write_block(fd, blk); blk.clear(); }
+	}
+	if(!rd.good()) throw std::runtime_error("bulk_load: cannot read " + std::string(fname));
+	write_block(fd, blk);
+	return count;
+}
+
+// The infile strategy. Returns false if the engine has no infile
+// query or the load fails. The server may skip rows that it cannot
+// load without an error, as LOAD DATA LOCAL does for duplicate keys, so
+// a load of fewer rows than the file has is rolled back and throws.
+// Unless tx is false, the load has its own transaction.
+static bool load_infile(row_stmts& rs, const char* fname, off_t from, off_t to,
+	bool tx, size_t& count)
+{
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+
+	std::string tmp = std::string(b->rootdir) + "/.bulk-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if(fd < 0) return false;
+
+	// a malformed file is an error of the commit, not of the strategy
+	try {
+		count = write_loader(rs, fd, fname, from, to);
+	}
+	catch(...) {
+		close(fd);
+		unlink(tmp.c_str());
+		throw;
+	}
+	close(fd);
+
+	bool ok = false, begun = false;
+	unsigned long long loaded = 0;
+	try {
+		std::vector<std::string> a;
+		a.push_back(rs.db);
+		a.push_back(rs.tab);
+		a.push_back(rs.col_list);
+		a.push_back(tmp);
+		std::vector<std::string> q = rt_call("bulk_load", a);
+		if(q.size() && q[0].size()) {
+			log_vmsg("+ bulk_load: %s\n", q[0].c_str());
+			cppdb::statement st = db->sql->create_statement(q[0]);
+			if(tx && !db->tx) { db->sql->begin(); begun = true; }
+			st.exec();
+			loaded = st.affected();
+			ok = true;
+			if(begun) {
+				if(loaded == count) db->sql->commit();
+				else db->sql->rollback();
+				begun = false;
+			}
+		}
+	}
+	catch(std::exception& e)
+		{ log_msg("+ bulk_load infile failed: %s\n", e.what()); }
+	catch(retranse::rtex& e)
+		{ log_msg("+ bulk_load infile failed: %s\n", e.s.c_str()); }
+	if(begun) {
+		ok = false;
+		try { db->sql->rollback(); } catch(...) {}
+	}
+
+	unlink(tmp.c_str());
+	if(ok && loaded != count) {
+		char m[96];
+		sprintf(m, "%llu of %lu rows loaded", loaded, (unsigned long) count);
+		throw std::runtime_error("bulk_load: " + rs.tab + ": " + m);
+	}
+	return ok;
+}
+
+// Insert the rows of the file with the prepared statement
+static size_t insert_rows(row_stmts& rs, const char* fname, off_t from, off_t to)
+{
+	fmt_reader rd(fname, from, to);
+	fmt_rows rows;
+	size_t count = 0;
+	while(rd.next(rows)) {
+		for(size_t r = 0; r < rows.rows.size(); r++)
+			rs.insert(rows, r);
+		count += rows.rows.size();
+	}
+	if(!rd.good()) throw std::runtime_error("bulk_load: cannot read " + std::string(fname));
+	return count;
+}
+
+// The insert strategy
+static size_t load_insert(row_stmts& rs, const char* fname, off_t from, off_t to,
+	bool tx)
+{
+	db_conn* db = FS_DB;
+
+	if(!tx || db->tx) return insert_rows(rs, fname, from, to);
+	cppdb::transaction tr(*db->sql);
+	size_t count = insert_rows(rs, fname, from, to);
+	tr.commit();
+	return count;
+}
+
+size_t bulk_load(const char* p1, const char* p2, const std::string& header,
+	const char* fname, off_t from, off_t to, bool tx)
+{
+	log_vmsg("+ bulk_load(%s, %s, %s, %lld, %lld)\n", p1, p2, fname,
+		(long long) from, (long long) to);
+
+	db_conn* db = FS_DB;
+	row_stmts& rs = db->stmts->get(p1, p2, header);
+
+	size_t count = 0;
+	if(rt_call("bulk_mode").at(0) == "infile" && load_infile(rs, fname, from, to, tx, count)) {
+		log_msg("+ bulk_load: %lu rows loaded from file\n", (unsigned long) count);
+		return count;
+	}
+
+	count = load_insert(rs, fname, from, to, tx);
+	log_msg("+ bulk_load: %lu rows inserted\n", (unsigned long) count);
+	return count;
+}
@@ -0,0 +1,46 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef BULK_INCLUDED
+#define BULK_INCLUDED
+
+#include <sys/types.h>
+#include <string>
+
+// Bulk loading of rows into a table. The strategy is given by the
+// function bulk_mode of the retranse configuration:
+//   infile: the rows are converted to the loader format of the engine
+//           in a temporary file, that is loaded with the query of the
+//           function bulk_load (LOAD DATA LOCAL INFILE for mysql)
+//   insert: the rows are inserted with a prepared statement, all in a
+//           single transaction
+// If the infile load fails, for example because the server does not
+// allow local files, the insert strategy is used instead. If it loads
+// fewer rows than the file has, which LOAD DATA LOCAL does without an
+// error for rows with a duplicate key, the load is an error.
+
+// Load the rows of file `fname' between the byte offsets `from' and `to'
+// (-1 for the end of the file) into table p2 of database p1, whose file
+// has the given header line. Returns the number of rows loaded.
+// If tx is false the caller has already started a transaction, as has a
+// commit that holds a transaction on the connection.
+size_t bulk_load(const char* p1, const char* p2, const std::string& header,
+	const char* fname, off_t from = 0, off_t to = -1, bool tx = true);
+
+#endif
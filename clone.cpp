@@ -0,0 +1,89 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "clone.hpp"
+
+bool fs_copyfile(const char* src, int fd)
+{
+	int in = open(src, O_RDONLY);
+	if(in < 0) return false;
+	std::vector<char> buf(1 << 20);
+	ssize_t n;
+	while((n = read(in, &buf[0], buf.size())) > 0)
+		if(write(fd, &buf[0], n) != n) { n = -1; break; }
+	close(in);
+	return n == 0;
+}
+
+// Append bytes [from, to) of file src to the open file descriptor out
+static bool append_fd(const char* src, int out, off_t from, off_t to)
+{
+	int in = open(src, O_RDONLY);
+	if(in < 0) return false;
+	std::vector<char> buf(1 << 20);
+	while(from < to) {
+		ssize_t n = pread(in, &buf[0], std::min((off_t) buf.size(), to - from), from);
+		if(n <= 0 || write(out, &buf[0], n) != n) break;
+		from += n;
+	}
+	close(in);
+	return from == to;
+}
+
+// Write a new copy of src in dir, with bytes [from, to) of file app
+// appended if app is given, and rename it to dst
+static bool clone_write(const char* src, const char* dst, const char* dir,
+	const char* app, off_t from, off_t to, bool sync)
+{
+	std::string tmp = std::string(dir) + "/clone-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if(fd < 0) return false;
+	bool ok = fs_copyfile(src, fd) && (!app || append_fd(app, fd, from, to))
+		&& (!sync || !fsync(fd));
+	ok = !close(fd) && ok;
+	if(!ok || rename(tmp.c_str(), dst)) {
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool clone_copy(const char* src, const char* dst, const char* dir, bool sync)
+{
+	return clone_write(src, dst, dir, NULL, 0, 0, sync);
+}
+
+bool clone_append(const char* src, const char* clone, off_t from, off_t to,
+	const char* dir, bool sync)
+{
+	struct stat st;
+	if(stat(clone, &st)) return false;
+	if(st.st_nlink != 1) return clone_write(clone, clone, dir, src, from, to, sync);
+	int fd = open(clone, O_WRONLY | O_APPEND);
+	if(fd < 0) return false;
+	bool ok = append_fd(src, fd, from, to) && (!sync || !fsync(fd));
+	return !close(fd) && ok;
+}
@@ -0,0 +1,46 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef CLONE_INCLUDED
+#define CLONE_INCLUDED
+
+#include <sys/types.h>
+
+// The baseline clones of table files. A clone is never changed while it
+// has another link, such as a journal entry: it is written aside in the
+// directory of temporary clones and renamed over the old one, so the
+// other links keep the baseline they were taken of. With sync, the data
+// of the clone is on disk before it is in place, so that a journal entry
+// can link it without syncing it again.
+
+// Copy file src to the open file descriptor fd
+bool fs_copyfile(const char* src, int fd);
+
+// Make file dst a new copy of file src, written in directory dir and
+// renamed into place. Returns false on error.
+bool clone_copy(const char* src, const char* dst, const char* dir,
+	bool sync = false);
+
+// Append bytes [from, to) of file src to clone `clone': in place if it
+// has no other link, or to a new copy written in directory dir otherwise.
+// Returns false on error, when the clone may be lost.
+bool clone_append(const char* src, const char* clone, off_t from, off_t to,
+	const char* dir, bool sync = false);
+
+#endif
@@ -0,0 +1,922 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include "pstream.h"
+#include "textfmt.hpp"
+#include "bulk.hpp"
+#include "rowdiff.hpp"
+#include "commit.hpp"
+#include <algorithm>
+
+// Number of changed rows from which they are applied in parallel, when
+// there is a pool of sessions
+#define PAR_MIN_ROWS 10000
+
+// Create a new table from data in file `from`, p1=db, p2=table name
+bool run_create(const char *from, const char* p1, const char* p2)
+{
+	log_vmsg("+ run_create(%s, %s, %s)\n",from,p1,p2);
+
+	db_conn* db = FS_DB;
+
+	std::string header = read_header(from);
+
+	if(header.size()) {
+		log_vmsg("+ + creating table with: %s\n",header.c_str());
+		db->stmts->drop(p1, p2);
+		db->h->mk_tab(p1, p2, header);
+		log_vmsg("+ + created table.\n");
+	}
+	else return false;
+
+	sql2text::tbl info;
+	try{
+		db->h->info_tab(info, p1, p2);
+	}
+	catch(retranse::rtex& r)
+	{
+		log_vmsg("+ + crerr_retranse!!:%s:@%s/%s\n",from,p1,p2);
+		return false;
+	}
+	catch(std::exception& r)
+	{
+		log_vmsg("+ + crerr_std!!:%s:@%s/%s==%s\n",from,p1,p2,r.what());
+		return false;
+	}
+	catch(...)
+	{
+		log_vmsg("+ + crerr!!:%s:@%s/%s\n",from,p1,p2);
+		return false;
+	}
+
+	// load all the rows after the header line
+	bulk_load(p1, p2, header, from, header.size() + 1);
+	log_msg("+ run_create: ok!\n");
+
+	return true;
+}
+
+// Parse a hunk header of `diff' normal output, such as 3,5c3,4
+// Sets the first line numbers of the hunk in the left and right file.
+static bool diff_hunk(const std::string& line, long& left, long& right)
+{
+	const char* p = line.c_str();
+	char* e;
+	left = strtol(p, &e, 10);
+	if(e == p) return false;
+	while(*e && !strchr("acd", *e)) e++;
+	if(!*e) return false;
+	right = strtol(e + 1, NULL, 10);
+	return true;
+}
+
+static size_t apply_rows(row_stmts& rs, const std::string& add, const std::string& rm,
+	bool merge = false);
+
+// Applies the batches of rows of diff_set with apply_rows
+struct apply_sink : diff_sink {
+	row_stmts& rs;
+	bool merge;
+	size_t ch;
+
+	apply_sink(row_stmts& r, bool m) : rs(r), merge(m), ch(0) {}
+	void apply(const std::string& add, const std::string& rm)
+		{ ch += apply_rows(rs, add, rm, merge); }
+};
+
+// Apply the rows whose count differs between the files from and to
+// with diff_set. Returns the number of rows applied.
+static size_t apply_set(row_stmts& rs, const char* from, const char* to, bool merge)
+{
+	apply_sink out(rs, merge);
+	if(!diff_set(rs, from, to, out))
+		throw std::runtime_error("diff_set: cannot read " + std::string(from));
+	return out.ch;
+}
+
+// Order-insensitive commit: only the rows whose count differs between
+// the file and its baseline are applied, so reordering the rows of a
+// file changes nothing.
+static bool commit_set(const char* from, const char* to, const char* p1, const char* p2)
+{
+	db_conn* db = FS_DB;
+
+	row_stmts& rs = db->stmts->get(p1, p2, read_header(to));
+	return apply_set(rs, from, to, false) != 0;
+}
+
+// The name of the temporary staging table of commit_stage
+#define STAGE_TAB "sql2textfs_stage"
+
+// Load the file into the staging table and apply it to the table, with
+// the arguments a of the stage functions, the join condition on of the
+// key columns and the quoted non-key columns vals. Returns the number of
+// rows changed.
+static unsigned long long stage_apply(row_stmts& rs, const char* from,
+	const std::vector<std::string>& a, const std::string& on,
+	const std::vector<std::string>& vals)
+{
+	unsigned long long ch = 0;
+	bulk_load(a[0].c_str(), STAGE_TAB, rs.header, from, rs.header.size() + 1, -1, false);
+
+	std::vector<std::string> d(a);
+	d.push_back(on);
+	ch += rt_exec("stage_del", d);
+
+	if(vals.size()) {
+		std::vector<std::string> u(a);
+		u.push_back(join_cols("stage_set", vals, ", "));
+		u.push_back(on);
+		u.push_back(join_cols("stage_same", vals, " AND "));
+		ch += rt_exec("stage_upd", u);
+	}
+
+	std::vector<std::string> n(a);
+	n.push_back(rs.col_list);
+	n.push_back(on);
+	ch += rt_exec("stage_ins", n);
+	return ch;
+}
+
+// Set-based commit of a table with a primary key: the file is
+// bulk-loaded into a temporary staging table and the server deletes the
+// rows whose key is no longer there, updates the changed rows and
+// inserts the new ones, with one statement each, in a single
+// transaction.
+static bool commit_stage(row_stmts& rs, const char* from, const char* p1, const char* p2)
+{
+	log_vmsg("+ commit_stage(%s, %s, %s)\n", from, p1, p2);
+
+	db_conn* db = FS_DB;
+
+	std::vector<std::string> all, keys, vals;
+	for(size_t i = 0; i < rs.cols.size(); i++) {
+		std::string q = rt_call("q_col", std::vector<std::string>(1, rs.cols.names[i])).at(0);
+		all.push_back(q);
+		if(rs.cols.key[i]) keys.push_back(q);
+		else vals.push_back(q);
+	}
+	std::string on = join_cols("stage_col_eq", keys, " AND ");
+
+	std::vector<std::string> a;
+	a.push_back(p1);
+	a.push_back(STAGE_TAB);
+	rt_exec("stage_rm", a);
+	a.insert(a.begin() + 1, p2);
+	rt_exec("stage_mk", a);
+
+	unsigned long long ch = 0;
+	try {
+		if(db->tx) ch = stage_apply(rs, from, a, on, vals);
+		else {
+			cppdb::transaction tr(*db->sql);
+			ch = stage_apply(rs, from, a, on, vals);
+			tr.commit();
+		}
+	}
+	catch(...) {
+		db->stmts->drop(p1, STAGE_TAB);
+		a.erase(a.begin() + 1);
+		try { rt_exec("stage_rm", a); } catch(...) {}
+		throw;
+	}
+	db->stmts->drop(p1, STAGE_TAB);
+	a.erase(a.begin() + 1);
+	rt_exec("stage_rm", a);
+
+	log_vmsg("+ commit_stage: %llu rows changed\n", ch);
+	return ch != 0;
+}
+
+// Commit the file `from' against its baseline `to' as a whole, with the
+// row diff mode of the mount, or through a staging table
+static bool commit_full(const char* from, const char* to, const char* p1, const char* p2)
+{
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+
+	if(b->stage) {
+		row_stmts& rs = db->stmts->get(p1, p2, read_header(to));
+		if(rs.cols.has_key() && read_header(from) == rs.header)
+			return commit_stage(rs, from, p1, p2);
+	}
+
+	if(b->diffmode == DIFF_KEY) {
+		// tables without primary key, or files that are not in key
+		// order, are compared as multisets
+		size_t ch;
+		if(merge_key(db->stmts->get(p1, p2, read_header(to)), from, to, ch))
+			return ch != 0;
+	}
+	if(b->diffmode != DIFF_LINE) return commit_set(from, to, p1, p2);
+	return exec_diff(from, to, p1, p2);
+}
+
+// Execute `diff' to find modified lines. Apply modifications to database.
+bool exec_diff(const char *from, const char *to, const char* p1, const char* p2)
+{
+	log_vmsg("+ exec_diff(%s, %s, %s, %s)\n",from,to,p1,p2);
+
+	db_conn* db = FS_DB;
+
+	// The statements are prepared for the schema of the baseline
+	row_stmts& rs = db->stmts->get(p1, p2, read_header(to));
+
+	// Execution of `diff'
+	std::vector<std::string> arg;
+	arg.push_back("/usr/bin/diff");
+	arg.push_back(from);
+	arg.push_back(to);
+	redi::ipstream is("/usr/bin/diff", arg);
+	std::string line;
+
+	// Collect the added and removed rows. The header lines are
+	// line 1 of each file and are skipped.
+	std::string add, rm;
+	long left = 0, right = 0;
+	while (std::getline(is, line)) {
+		log_vmsg("+ + diff line=%s\n",line.c_str());
+		if(line.size()>=2 && line[0]=='<')
+			{ if(left++ != 1) { add.append(line, 2, std::string::npos); add += '\n'; } }
+		else if(line.size()>=2 && line[0]=='>')
+			{ if(right++ != 1) { rm.append(line, 2, std::string::npos); rm += '\n'; } }
+		else if(line.size() && isdigit(line[0]))
+			diff_hunk(line, left, right);
+	}
+
+	size_t ch = apply_rows(rs, add, rm);
+	log_vmsg("+ exec_diff: ok!\n");
+
+	if(ch) return true;
+	return false;
+}
+
+// Apply the added and removed rows, given as text, to the database, on
+// the session of rs.
+// Rows that are removed and added with the same primary key are updated
+// in place. Removed rows are deleted before the added rows are inserted.
+// With merge, the rows are applied to a table that other clients may
+// have changed since the baseline: the added rows of a table with a
+// primary key update any row with their key, or are inserted if it is
+// no longer there. Returns the number of rows added and removed.
+static size_t apply_serial(row_stmts& rs, const std::string& add, const std::string& rm,
+	bool merge)
+{
+	fmt_rows ar, rr;
+	fmt_parse(add.data(), add.size(), ar);
+	fmt_parse(rm.data(), rm.size(), rr);
+	size_t ch = ar.rows.size() + rr.rows.size();
+
+	// Pair removed and added rows by primary key
+	std::vector<char> upd(ar.rows.size(), 0);
+	std::vector<char> del(rr.rows.size(), 1);
+	if(rs.can_update()) {
+		std::map<std::string, size_t> rk;
+		for(size_t i = 0; i < rr.rows.size(); i++)
+			rk[rs.key(rr, i)] = i;
+		for(size_t i = 0; i < ar.rows.size(); i++) {
+			std::map<std::string, size_t>::iterator it = rk.find(rs.key(ar, i));
+			if(it != rk.end() && del[it->second])
+				{ upd[i] = 1; del[it->second] = 0; }
+		}
+	}
+
+	// Update different lines:
+	if(rs.has_ups()) {
+		// upsert mode: the vanished keys are deleted in batches and
+		// the new and changed rows are upserted
+		pend_guard pg(rs);
+		for(size_t i = 0; i < rr.rows.size(); i++)
+			if(del[i]) rs.remove_later(rm.data() + rr.rows[i].line, rr.rows[i].len);
+		rs.flush();
+		for(size_t i = 0; i < ar.rows.size(); i++)
+			rs.upsert(ar, i);
+		return ch;
+	}
+	if(rs.cols.has_key()) {
+		for(size_t i = 0; i < rr.rows.size(); i++)
+			if(del[i]) rs.remove(rr, i);
+	}
+	else {
+		// identical rows of a table without primary key are grouped,
+		// and the groups are removed many at a time
+		std::map<std::string, std::pair<size_t, unsigned long> > g;
+		for(size_t i = 0; i < rr.rows.size(); i++) {
+			std::pair<size_t, unsigned long>& e = g[rs.key(rr, i)];
+			if(!e.second) e.first = i;
+			e.second++;
+		}
+		std::vector<std::pair<size_t, unsigned long> > gv;
+		std::map<std::string, std::pair<size_t, unsigned long> >::iterator it;
+		for(it = g.begin(); it != g.end(); ++it)
+			gv.push_back(it->second);
+		rs.remove_rows(rr, gv);
+	}
+	for(size_t i = 0; i < ar.rows.size(); i++) {
+		if(merge && rs.cols.has_key()) rs.merge(ar, i);
+		else if(upd[i]) rs.update(ar, i);
+		else rs.insert(ar, i);
+	}
+	return ch;
+}
+
+// A partition of the rows of a parallel apply, and its outcome
+struct part_job {
+	db_conn* db;
+	const row_stmts* rs;
+	std::string add, rm;
+	bool merge;
+	cppdb::transaction* tr;
+	size_t ch;
+	bool ok;
+};
+
+// Apply a partition in a transaction of its session, which is left open
+static void* part_run(void* p)
+{
+	part_job& j = *(part_job*) p;
+	fs_thread_db = j.db;
+	try {
+		char s[32];
+		sprintf(s, "%d", FS_DATA->lockwait);
+		rt_exec("lock_wait", std::vector<std::string>(1, s));
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ lock_wait config: %s\n", e.s.c_str()); }
+	catch(std::exception& e)
+		{ log_vmsg("+ lock_wait: %s\n", e.what()); }
+	try {
+		row_stmts& rs = j.db->stmts->get(j.rs->db.c_str(), j.rs->tab.c_str(), j.rs->header);
+		j.tr = new cppdb::transaction(*j.db->sql);
+		j.ch = apply_serial(rs, j.add, j.rm, j.merge);
+		j.ok = true;
+	}
+	catch(std::exception& e) {
+		log_msg("    ERROR part_run: %s\n", e.what());
+	}
+	catch(...) {
+		log_msg("    ERROR part_run: apply failed\n");
+	}
+	return NULL;
+}
+
+// Split the rows of text s among the partitions, by the hash of their key
+static void part_split(const row_stmts& rs, const std::string& s,
+	std::vector<part_job>& jobs, std::string part_job::* field)
+{
+	fmt_rows rows;
+	fmt_parse(s.data(), s.size(), rows);
+	for(size_t i = 0; i < rows.rows.size(); i++) {
+		std::string k = rs.key(rows, i);
+		std::string& t = jobs[row_hash(k.data(), k.size()) % jobs.size()].*field;
+		t.append(s, rows.rows[i].line, rows.rows[i].len);
+		t += '\n';
+	}
+}
+
+// Apply the rows with apply_serial in a transaction of the session of rs
+static size_t apply_tx(row_stmts& rs, const std::string& add, const std::string& rm,
+	bool merge)
+{
+	cppdb::transaction tr(*rs.sql);
+	size_t ch = apply_serial(rs, add, rm, merge);
+	tr.commit();
+	return ch;
+}
+
+// Apply the added and removed rows. A large change set is split by
+// primary key hash among the pooled sessions and applied on all of them
+// at once, each in its own transaction. The transactions are committed
+// once all the partitions are applied, or all rolled back if any fails.
+// Rows with the same key are in the same partition, so they are applied
+// in the same order as by apply_serial. Rows of different partitions
+// may still lock each other, through a unique secondary index or a
+// foreign key: a partition that waits for another fails after lockwait
+// seconds, or at once on a deadlock, and the change set is then applied
+// again serially, in a single transaction. Once a partition has been
+// committed, a later failure leaves the table partly changed.
+static size_t apply_rows(row_stmts& rs, const std::string& add, const std::string& rm,
+	bool merge)
+{
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+
+	// the pool is not used within the transaction of a commit, which
+	// may hold locks that the pooled sessions would wait for, nor
+	// while another commit uses it
+	size_t lines = std::count(add.begin(), add.end(), '\n')
+		+ std::count(rm.begin(), rm.end(), '\n');
+	if(b->pool.empty() || db->tx || lines < PAR_MIN_ROWS
+		|| pthread_mutex_trylock(&b->plock))
+		return apply_serial(rs, add, rm, merge);
+
+	std::vector<part_job> jobs(b->pool.size());
+	for(size_t i = 0; i < jobs.size(); i++) {
+		jobs[i].db = b->pool[i];
+		jobs[i].rs = &rs;
+		jobs[i].merge = merge;
+		jobs[i].tr = NULL;
+		jobs[i].ch = 0;
+		jobs[i].ok = false;
+	}
+	part_split(rs, add, jobs, &part_job::add);
+	part_split(rs, rm, jobs, &part_job::rm);
+	log_vmsg("+ apply_rows: %lu rows on %lu sessions\n",
+		(unsigned long) lines, (unsigned long) jobs.size());
+
+	db_conn* self = fs_thread_db;
+	std::vector<pthread_t> th(jobs.size());
+	std::vector<char> started(jobs.size(), 0);
+	for(size_t i = 0; i < jobs.size(); i++)
+		started[i] = !pthread_create(&th[i], NULL, part_run, &jobs[i]);
+	for(size_t i = 0; i < jobs.size(); i++) {
+		if(started[i]) pthread_join(th[i], NULL);
+		// a partition without a thread is applied here
+		else part_run(&jobs[i]);
+	}
+	fs_thread_db = self;
+
+	bool ok = true;
+	size_t ch = 0, done = 0;
+	for(size_t i = 0; i < jobs.size(); i++) {
+		ok = ok && jobs[i].ok;
+		ch += jobs[i].ch;
+	}
+	try {
+		for(; ok && done < jobs.size(); done++)
+			jobs[done].tr->commit();
+	}
+	catch(...) {
+		ok = false;
+	}
+	// the transactions that are not committed are rolled back
+	for(size_t i = 0; i < jobs.size(); i++)
+		delete jobs[i].tr;
+	pthread_mutex_unlock(&b->plock);
+	if(ok) return ch;
+	// once a part is committed, the others cannot be applied again
+	if(done) throw std::runtime_error("apply_rows: a partition failed to commit");
+	log_msg("    apply_rows: a partition failed, applying the rows serially\n");
+	return apply_tx(rs, add, rm, merge);
+}
+
+void track_reset(const char* path, const char* fgpath)
+{
+	track_reset(FS_DATA->files[path], fgpath);
+}
+
+void track_reset(fs_file& f, const char* fgpath)
+{
+	struct stat st;
+	f.base = stat((std::string(fgpath) + DBCLONEEXT).c_str(), &st) ? 0 : st.st_size;
+	f.low = -1;
+	f.trunc = -1;
+	f.dirty.clear();
+}
+
+// Add the range [s, e) to the disjoint ranges d, merging it with the
+// ranges it overlaps or touches
+static void dirty_add(std::map<off_t, off_t>& d, off_t s, off_t e)
+{
+	if(s >= e) return;
+	std::map<off_t, off_t>::iterator it = d.upper_bound(s);
+	if(it != d.begin()) {
+		--it;
+		if(it->second >= s) {
+			s = it->first;
+			if(it->second > e) e = it->second;
+			d.erase(it++);
+		}
+		else ++it;
+	}
+	while(it != d.end() && it->first <= e) {
+		if(it->second > e) e = it->second;
+		d.erase(it++);
+	}
+	d[s] = e;
+}
+
+void track_write(const char* path, off_t off, off_t size)
+{
+	std::map<std::string, fs_file>& fl = FS_DATA->files;
+	std::map<std::string, fs_file>::iterator it = fl.find(path);
+	if(it != fl.end()) track_write(it->second, off, size);
+}
+
+void track_write(fs_file& f, off_t off, off_t size)
+{
+	if(f.low < 0 || off < f.low) f.low = off;
+	dirty_add(f.dirty, off, off + size);
+	// the writes come through the kernel, whose pages hold them
+	if(f.cached == f.gen) f.cached++;
+	f.gen++;
+}
+
+void track_truncate(const char* path, off_t from, off_t to)
+{
+	std::map<std::string, fs_file>& fl = FS_DATA->files;
+	std::map<std::string, fs_file>::iterator it = fl.find(path);
+	if(it != fl.end()) track_truncate(it->second, from, to);
+}
+
+void track_truncate(fs_file& f, off_t from, off_t to)
+{
+	// growing the file writes zeros after its old end
+	if(to < from) track_write(f, to, from - to);
+	else track_write(f, from, to - from);
+	if(to < from && (f.trunc < 0 || to < f.trunc))
+		f.trunc = to;
+}
+
+bool track_written(const fs_file& f, const char* fgpath)
+{
+	struct stat st;
+	return f.low >= 0 || stat(fgpath, &st) || st.st_size != f.base;
+}
+
+// True if the n bytes at s are stored as they are by a column of the
+// given data type: text and binary values, char and varchar values
+// that fit their size, and integers in their shortest form. The server
+// may convert values of the other types to its own form.
+static bool value_as_written(const std::string& type, const char* s, size_t n)
+{
+	if(type.empty()) return false;
+	size_t sz = atol(type.c_str() + 1);
+	switch(type[0]) {
+	case 't': case 'T': case 'b': case 'B':
+		return true;
+	case 'c':
+		if(n && s[n - 1] == ' ') return false;	// trailing spaces are dropped
+		// fall through
+	case 'v':
+		return !sz || n <= sz;
+	case 'i': case 'I': {
+		size_t i = (n && *s == '-') ? 1 : 0;
+		if(i == n || (s[i] == '0' && (n > i + 1 || i))) return false;
+		for(; i < n; i++)
+			if(s[i] < '0' || s[i] > '9') return false;
+		return true;
+	}
+	}
+	return false;
+}
+
+// True if the rows of file fgpath between offsets from and to are
+// stored by the server as they are written: the table has no
+// autoincrement column, whose values the server may assign, no row has
+// NULL in a NOT NULL column, which the server may replace with the
+// default of the column, and every value is stored as it is written
+static bool stored_as_written(const row_stmts& rs, const char* fgpath, off_t from, off_t to)
+{
+	if(rs.cols.has_autoinc()) return false;
+	fmt_reader rd(fgpath, from, to);
+	fmt_rows rows;
+	while(rd.next(rows))
+		for(size_t r = 0; r < rows.rows.size(); r++) {
+			if(rows.fields(r) != rs.cols.size()) return false;
+			for(size_t i = 0; i < rs.cols.size(); i++) {
+				size_t f = rows.rows[r].first + i;
+				if(rows.null(f)) {
+					if(rs.cols.notnull[i]) return false;
+				}
+				else if(!value_as_written(rs.cols.types[i],
+					rows.data.data() + rows.start(f), rows.size(f)))
+					return false;
+			}
+		}
+	return rd.good();
+}
+
+// Append-only commit: all writes since the baseline are at or after its
+// end, so only the appended rows are parsed and bulk-loaded. If they are
+// stored as they are written, the appended bytes are also added to the
+// baseline clone, instead of reading the whole table again.
+static bool commit_append(fs_file& f, const char* fgpath, const char* p1,
+	const char* p2, off_t size)
+{
+	db_conn* db = FS_DB;
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+	std::string header = read_header(clone.c_str());
+
+	log_vmsg("+ commit_append(%s, %lld, %lld)\n", fgpath, (long long) f.base, (long long) size);
+	bulk_load(p1, p2, header, fgpath, f.base, size);
+
+	if(!stored_as_written(db->stmts->get(p1, p2, header), fgpath, f.base, size))
+		return true;
+	if(!clone_append(fgpath, clone.c_str(), f.base, size,
+		(std::string(FS_DATA->rootdir) + PRIVDIR).c_str(), FS_DATA->journal != NULL))
+		return true;	// the baseline is lost, read it again
+	track_reset(f, fgpath);
+	return false;
+}
+
+// True if the file has only been appended to since its baseline:
+// every write is at or after the baseline size and the baseline ends
+// with a complete line.
+static bool is_append(const fs_file& f, const char* fgpath, off_t size)
+{
+	if(f.low < f.base || size < f.base) return false;
+	if(!f.base) return false;	// not even a header
+
+	char c = 0;
+	int fd = open(fgpath, O_RDONLY);
+	if(fd < 0) return false;
+	bool nl = pread(fd, &c, 1, f.base - 1) == 1 && c == '\n';
+	close(fd);
+	return nl;
+}
+
+// Empty the table with rm_data, with the arguments a, and load the rows
+// of the file, if it has a header
+static void rewrite_rows(const char* fgpath, const std::vector<std::string>& a,
+	const std::string& header)
+{
+	rt_exec("rm_data", a);
+	if(header.size())
+		bulk_load(a[0].c_str(), a[1].c_str(), header, fgpath, header.size() + 1, -1, false);
+}
+
+// Full rewrite commit: the file has been truncated within its header
+// line and written again, so every row is replaced. The table is
+// emptied with rm_data and the new rows are bulk-loaded, in a single
+// transaction. An empty file empties the table.
+static bool commit_rewrite(const char* fgpath, const char* p1, const char* p2,
+	const std::string& header)
+{
+	log_vmsg("+ commit_rewrite(%s)\n", fgpath);
+
+	db_conn* db = FS_DB;
+	std::vector<std::string> a;
+	a.push_back(p1);
+	a.push_back(p2);
+
+	if(db->tx) rewrite_rows(fgpath, a, header);
+	else {
+		cppdb::transaction tr(*db->sql);
+		rewrite_rows(fgpath, a, header);
+		tr.commit();
+	}
+	return true;
+}
+
+// True if the file has been truncated within the header line of its
+// baseline and then rewritten with the same header, or left empty
+static bool is_rewrite(const fs_file& f, const std::string& base_header,
+	const std::string& header, off_t size)
+{
+	if(f.trunc < 0 || f.trunc > (off_t) base_header.size() + 1) return false;
+	return size == 0 || header == base_header;
+}
+
+// Offset of the start of the line that contains byte s of file fd,
+// searching back to offset lo. Returns lo if no line break is found.
+static off_t line_start(int fd, off_t s, off_t lo)
+{
+	char buf[4096];
+	while(s > lo) {
+		off_t p = s - (off_t) sizeof(buf) < lo ? lo : s - (off_t) sizeof(buf);
+		ssize_t n = pread(fd, buf, s - p, p);
+		if(n != s - p) return lo;
+		for(ssize_t i = n; i > 0; i--)
+			if(buf[i - 1] == '\n') return p + i;
+		s = p;
+	}
+	return lo;
+}
+
+// Offset after the first line break of file fd at or after offset e,
+// searching up to offset hi. Returns hi if no line break is found.
+static off_t line_end(int fd, off_t e, off_t hi)
+{
+	char buf[4096];
+	while(e < hi) {
+		size_t m = hi - e < (off_t) sizeof(buf) ? hi - e : sizeof(buf);
+		ssize_t n = pread(fd, buf, m, e);
+		if(n <= 0) return hi;
+		const char* nl = (const char*) memchr(buf, '\n', n);
+		if(nl) return e + (nl - buf) + 1;
+		e += n;
+	}
+	return hi;
+}
+
+// Split bytes [s, e) of file fd into lines and append them to v
+static bool read_lines(int fd, off_t s, off_t e, std::vector<std::string>& v)
+{
+	std::string buf(e - s, 0);
+	if(e > s && pread(fd, &buf[0], e - s, s) != e - s) return false;
+	size_t p = 0;
+	while(p < buf.size()) {
+		size_t q = buf.find('\n', p);
+		if(q == std::string::npos) q = buf.size();
+		v.push_back(buf.substr(p, q - p + 1));
+		if(v.back()[v.back().size() - 1] != '\n') v.back() += '\n';
+		p = q + 1;
+	}
+	return true;
+}
+
+// Dirty range commit: the file has been written in place, so the bytes
+// outside its dirty ranges are those of the baseline at the same offsets.
+// Each dirty range is widened to whole lines, which are then the same
+// in both files at its ends, and only its lines are compared against
+// the lines of the same range in the baseline. Falls back to commit_full
+// if the dirty lines are a large part of the file.
+static bool commit_dirty(const fs_file& f, const char* fgpath, const char* p1,
+	const char* p2, off_t size)
+{
+	db_conn* db = FS_DB;
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+
+	std::map<off_t, off_t> d(f.dirty);
+	off_t msize = size < f.base ? size : f.base;
+	off_t xsize = size < f.base ? f.base : size;
+	dirty_add(d, msize, xsize);
+
+	int nfd = open(fgpath, O_RDONLY);
+	int bfd = open(clone.c_str(), O_RDONLY);
+	if(nfd < 0 || bfd < 0) {
+		if(nfd >= 0) close(nfd);
+		if(bfd >= 0) close(bfd);
+		return commit_full(fgpath, clone.c_str(), p1, p2);
+	}
+
+	// Widen the ranges to line boundaries within the clean bytes,
+	// which are the same in both files, merging ranges that meet
+	std::vector<std::pair<off_t, off_t> > seg;
+	off_t total = 0;
+	for(std::map<off_t, off_t>::iterator it = d.begin(); it != d.end(); ++it) {
+		off_t lo = seg.empty() ? 0 : seg.back().second;
+		off_t s = line_start(nfd, it->first < lo ? lo : it->first, lo);
+		if(!seg.empty() && s == lo) seg.back().second = it->second;
+		else seg.push_back(std::make_pair(s, it->second));
+
+		std::map<off_t, off_t>::iterator nx = it;
+		++nx;
+		off_t hi = nx == d.end() ? msize : nx->first;
+		off_t e = seg.back().second;
+		if(e < hi) seg.back().second = line_end(nfd, e, hi);
+	}
+	for(size_t i = 0; i < seg.size(); i++)
+		total += seg[i].second - seg[i].first;
+	log_vmsg("+ commit_dirty(%s, %lu ranges, %lld bytes)\n", fgpath,
+		(unsigned long) seg.size(), (long long) total);
+
+	std::string add, rm;
+	bool ok = total * 2 <= xsize;
+	for(size_t i = 0; ok && i < seg.size(); i++) {
+		std::vector<std::string> nl, bl;
+		off_t s = seg[i].first, e = seg[i].second;
+		ok = read_lines(nfd, s, e < size ? e : size, nl)
+			&& read_lines(bfd, s, e < f.base ? e : f.base, bl);
+		// line 1 is the header line
+		size_t j = s ? 0 : 1;
+		for(; j < nl.size() || j < bl.size(); j++) {
+			if(j < nl.size() && j < bl.size() && nl[j] == bl[j]) continue;
+			if(j < nl.size()) add += nl[j];
+			if(j < bl.size()) rm += bl[j];
+		}
+	}
+	close(nfd);
+	close(bfd);
+	if(!ok) return commit_full(fgpath, clone.c_str(), p1, p2);
+
+	row_stmts& rs = db->stmts->get(p1, p2, read_header(clone.c_str()));
+	return apply_rows(rs, add, rm) != 0;
+}
+
+// Commit the changes of a table file against its baseline, by the
+// cheapest of the commits that its write state allows
+static bool commit_changes(fs_file* fp, const char* fgpath, const char* p1, const char* p2)
+{
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+
+	struct stat st;
+	if(fp && !stat(fgpath, &st)) {
+		fs_file& f = *fp;
+		// nothing written since the baseline
+		if(f.low < 0 && st.st_size == f.base) return false;
+		if(f.trunc >= 0) {
+			std::string bh = read_header(clone.c_str());
+			std::string h = read_header(fgpath);
+			if(is_rewrite(f, bh, h, st.st_size))
+				return commit_rewrite(fgpath, p1, p2, h);
+		}
+		if(is_append(f, fgpath, st.st_size))
+			return commit_append(f, fgpath, p1, p2, st.st_size);
+		// written in place, without truncation
+		if(f.trunc < 0)
+			return commit_dirty(f, fgpath, p1, p2, st.st_size);
+	}
+
+	return commit_full(fgpath, clone.c_str(), p1, p2);
+}
+
+std::string tab_version(const char* p1, const char* p2, const std::string& header, bool lock)
+{
+	std::vector<std::string> a;
+	a.push_back(p1);
+	a.push_back(p2);
+	try {
+		if(lock) rt_value("tab_lock", a);
+
+		tab_cols cols;
+		if(!cols.parse(header)) return "";
+		std::vector<std::string> q;
+		for(size_t i = 0; i < cols.size(); i++)
+			q.push_back(rt_call("q_col", std::vector<std::string>(1, cols.names[i])).at(0));
+		a.push_back(join_cols("ver_col", q, ", "));
+		return rt_value("tab_version", a);
+	}
+	catch(retranse::rtex& e) {
+		// the engine has no table versions
+		log_vmsg("+ tab_version config: %s\n", e.s.c_str());
+		return "";
+	}
+}
+
+// Three-way merge commit: the rows that the file adds to and removes
+// from its baseline are applied to the table as other clients have left
+// it, so their changes are kept, except for the rows that the file
+// changes too
+static bool commit_merge(const char* from, const char* to, const char* p1, const char* p2)
+{
+	log_vmsg("+ commit_merge(%s)\n", from);
+
+	db_conn* db = FS_DB;
+	row_stmts& rs = db->stmts->get(p1, p2, read_header(to));
+	return apply_set(rs, from, to, true) != 0;
+}
+
+bool commit_delta(const char* from, const char* to, const char* p1, const char* p2)
+{
+	log_vmsg("+ commit_delta(%s)\n", from);
+
+	db_conn* db = FS_DB;
+	cppdb::transaction tr(*db->sql);
+	db->tx = 1;
+	try {
+		bool rv = commit_merge(from, to, p1, p2);
+		tr.commit();
+		db->tx = 0;
+		return rv;
+	}
+	catch(...) {
+		db->tx = 0;
+		throw;
+	}
+}
+
+bool commit_tab(fs_file* fp, const char* fgpath, const char* p1, const char* p2)
+{
+	log_vmsg("+ commit_tab(%s)\n", fgpath);
+
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+	if(!b->merge) return commit_changes(fp, fgpath, p1, p2);
+
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+	struct stat st;
+	// nothing written since the baseline
+	if(fp && fp->low < 0 && !stat(fgpath, &st) && st.st_size == fp->base)
+		return false;
+
+	// The version is checked, and the changes applied, in a single
+	// transaction, after the table is locked against other writers
+	cppdb::transaction tr(*db->sql);
+	db->tx = 1;
+	try {
+		bool rv;
+		std::string v = tab_version(p1, p2, read_header(clone.c_str()), true);
+		if(fp && v.size() && v == fp->version)
+			rv = commit_changes(fp, fgpath, p1, p2);
+		else {
+			log_msg("+ commit_tab: %s/%s changed since it was read, merging\n", p1, p2);
+			rv = commit_merge(fgpath, clone.c_str(), p1, p2);
+		}
+		tr.commit();
+		db->tx = 0;
+		return rv;
+	}
+	catch(...) {
+		db->tx = 0;
+		throw;
+	}
+}
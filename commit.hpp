@@ -0,0 +1,75 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef COMMIT_INCLUDED
+#define COMMIT_INCLUDED
+
+#include <sys/types.h>
+
+// Committing the changes of table files to the database.
+// p1=db, p2=table name, path is the fs-relative path of the table file
+// and fgpath the path of its temporary file.
+
+// Create a new table from data in file `from`
+bool run_create(const char *from, const char* p1, const char* p2);
+
+struct fs_file;
+
+// Apply the changes of table file fgpath, with write state f (NULL if
+// not tracked), against its baseline clone. With the merge policy, if
+// the table has changed since the baseline was read, or its version is
+// not known, the changes are merged with the table as it is now.
+// Returns true if the database has been changed and the file needs to
+// be read again from the database.
+bool commit_tab(fs_file* f, const char* fgpath, const char* p1, const char* p2);
+
+// Apply the rows that file `from' adds to and removes from its baseline
+// `to' to table p2 of database p1 as it is now, in a single transaction,
+// as a commit with the merge policy does when the table has changed.
+// Returns true if the database has been changed.
+bool commit_delta(const char* from, const char* to, const char* p1, const char* p2);
+
+// The version of table p2 of database p1, whose file has the given
+// header line: a checksum of its rows computed by the server, or an
+// empty string if the engine has none. With lock, the rows are locked
+// against other writers until the end of the current transaction.
+std::string tab_version(const char* p1, const char* p2, const std::string& header,
+	bool lock = false);
+
+// Execute `diff' between the temporary files `from' and `to' and apply
+// the modifications to the database. Return true if there have been
+// modifications and they are applied.
+bool exec_diff(const char *from, const char *to, const char* p1, const char* p2);
+
+// Track the writes to a table file. track_reset starts tracking from
+// its current baseline clone, track_write records a write of size bytes
+// at offset off and track_truncate a truncation from size `from' to size
+// `to'. Both count up the generation of the contents of the file.
+void track_reset(const char* path, const char* fgpath);
+void track_reset(fs_file& f, const char* fgpath);
+void track_write(const char* path, off_t off, off_t size);
+void track_write(fs_file& f, off_t off, off_t size);
+void track_truncate(const char* path, off_t from, off_t to);
+void track_truncate(fs_file& f, off_t from, off_t to);
+
+// True if table file fgpath, with write state f, has been written to
+// since its baseline clone
+bool track_written(const fs_file& f, const char* fgpath);
+
+#endif
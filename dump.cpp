@@ -0,0 +1,249 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include <sched.h>
+#include "textfmt.hpp"
+#include "rowdiff.hpp"
+#include "dump.hpp"
+
+// Number of rows fetched in one batch
+#define DUMP_BATCH_ROWS 1024
+// Size of a block of encoded text written with a single write()
+#define DUMP_BLOCK_SIZE (1 << 20)
+// Number of entries of each queue between the stages
+#define DUMP_QUEUE_SIZE 8
+
+// Wait a little when a queue is empty or full. Spins for a while and
+// then sleeps, since the other side may be waiting for the network.
+static void backoff(int& n)
+{
+	if(n++ < 64) sched_yield();
+	else usleep(100);
+}
+
+// A bounded single-producer single-consumer queue of pointers.
+// Each index is written only by one of the two sides, so the queue
+// needs no lock. A null pointer marks the end of the stream.
+template<class T> struct spsc_queue {
+	T* q[DUMP_QUEUE_SIZE];
+	volatile unsigned head;
+	volatile unsigned tail;
+
+	spsc_queue() : head(0), tail(0) {}
+
+	void push(T* x)
+	{
+		int n = 0;
+		while(tail - head == DUMP_QUEUE_SIZE) backoff(n);
+		__sync_synchronize();
+		q[tail % DUMP_QUEUE_SIZE] = x;
+		__sync_synchronize();
+		tail = tail + 1;
+	}
+
+	T* pop()
+	{
+		int n = 0;
+		while(head == tail) backoff(n);
+		__sync_synchronize();
+		T* x = q[head % DUMP_QUEUE_SIZE];
+		__sync_synchronize();
+		head = head + 1;
+		return x;
+	}
+};
+
+// A batch of fetched rows: cols cells per row, row after row
+struct dump_batch {
+	size_t cols;
+	std::vector<std::string> cells;
+	std::vector<char> nulls;
+};
+
+// The state shared by the three stages of one dump
+struct dump_pipe {
+	int fd;
+	int error;
+	// checksum of the blocks written, which end at row boundaries
+	uint64_t sum;
+	spsc_queue<dump_batch> rows;
+	spsc_queue<std::string> blocks;
+};
+
+// Encoding stage: convert row batches to blocks of text
+static void* dump_encode(void* arg)
+{
+	dump_pipe* p = (dump_pipe*) arg;
+	std::string* blk = new std::string();
+	blk->reserve(DUMP_BLOCK_SIZE + DUMP_BLOCK_SIZE / 4);
+
+	while(dump_batch* bt = p->rows.pop()) {
+		for(size_t i = 0; i < bt->cells.size(); i++) {
+			if(i % bt->cols) *blk += '\t';
+			if(bt->nulls[i]) fmt_null(*blk);
+			else fmt_escape(bt->cells[i].data(), bt->cells[i].size(), *blk);
+			if(i % bt->cols == bt->cols - 1) {
+				*blk += '\n';
+				if(blk->size() >= DUMP_BLOCK_SIZE) {
+					p->blocks.push(blk);
+					blk = new std::string();
+					blk->reserve(DUMP_BLOCK_SIZE + DUMP_BLOCK_SIZE / 4);
+				}
+			}
+		}
+		delete bt;
+	}
+
+	if(blk->size()) p->blocks.push(blk);
+	else delete blk;
+	p->blocks.push(NULL);
+	return NULL;
+}
+
+// Write n bytes at s to fd. Returns 0 or the error number.
+static int write_all(int fd, const char* s, size_t n)
+{
+	while(n) {
+		ssize_t w = write(fd, s, n);
+		if(w < 0 && errno == EINTR) continue;
+		if(w < 0) return errno;
+		if(w == 0) return EIO;
+		s += w;
+		n -= w;
+	}
+	return 0;
+}
+
+// Add a block of text to a checksum
+static uint64_t sum_block(uint64_t h, const std::string& blk)
+{
+	return (h ^ row_hash(blk.data(), blk.size())) * 1099511628211ULL;
+}
+
+// Writing stage: write blocks of text to the file, and sum them. After
+// an error the remaining blocks are only drained.
+static void* dump_write(void* arg)
+{
+	dump_pipe* p = (dump_pipe*) arg;
+
+	while(std::string* blk = p->blocks.pop()) {
+		if(!p->error)
+			p->error = write_all(p->fd, blk->data(), blk->size());
+		p->sum = sum_block(p->sum, *blk);
+		delete blk;
+	}
+	return NULL;
+}
+
+bool dump_tab(const char* p1, const char* p2, const std::string& header,
+	const std::string& fname, uint64_t* sum)
+{
+	log_vmsg("+ dump_tab(%s, %s, %s)\n", p1, p2, fname.c_str());
+
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+
+	dump_pipe p;
+	p.fd = open(fname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(p.fd < 0) return false;
+
+	// the header line goes first
+	std::string hl = header + "\n";
+	p.error = write_all(p.fd, hl.data(), hl.size());
+	p.sum = sum_block(0, hl);
+	if(p.error) {
+		close(p.fd);
+		return false;
+	}
+
+	pthread_t enc, wr;
+	if(pthread_create(&enc, NULL, dump_encode, &p)) {
+		close(p.fd);
+		return false;
+	}
+	if(pthread_create(&wr, NULL, dump_write, &p)) {
+		p.rows.push(NULL);
+		pthread_join(enc, NULL);
+		close(p.fd);
+		return false;
+	}
+
+	// Fetching stage, on the calling thread that owns the session
+	bool ok = true;
+	try {
+		std::vector<std::string> a;
+		a.push_back(p1);
+		a.push_back(p2);
+		// in key diff mode tables with a primary key are read in key order
+		const char* fn = "q_cat_tab";
+		tab_cols tc;
+		if(b->diffmode == DIFF_KEY && tc.parse(header) && tc.has_key()) {
+			std::vector<std::string> keys;
+			for(size_t i = 0; i < tc.size(); i++)
+				if(tc.key[i]) keys.push_back(tc.names[i]);
+			a.push_back(join_cols("q_col", keys, ", "));
+			fn = "q_cat_tab_key";
+		}
+		std::vector<std::string> q = rt_call(fn, a);
+
+		cppdb::statement st = db->sql->create_statement(q.at(0));
+		for(size_t i = 1; i < q.size(); i++)
+			st.bind(q[i]);
+		cppdb::result r = st.query();
+
+		size_t cols = r.cols();
+		dump_batch* bt = NULL;
+		while(cols && r.next()) {
+			if(!bt) {
+				bt = new dump_batch();
+				bt->cols = cols;
+				bt->cells.reserve(cols * DUMP_BATCH_ROWS);
+				bt->nulls.reserve(cols * DUMP_BATCH_ROWS);
+			}
+			for(size_t i = 0; i < cols; i++) {
+				bt->cells.push_back(std::string());
+				bt->nulls.push_back(!r.fetch(i, bt->cells.back()));
+			}
+			if(bt->cells.size() >= cols * DUMP_BATCH_ROWS) {
+				p.rows.push(bt);
+				bt = NULL;
+			}
+		}
+		if(bt) p.rows.push(bt);
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ dump_tab config: %s\n", e.s.c_str()); ok = false; }
+	catch(std::exception& e)
+		{ log_vmsg("+ dump_tab cppdb: %s\n", e.what()); ok = false; }
+
+	p.rows.push(NULL);
+	pthread_join(enc, NULL);
+	pthread_join(wr, NULL);
+
+	if(close(p.fd) < 0 && !p.error) p.error = errno;
+	if(p.error) {
+		log_msg("+ dump_tab write error: %s\n", strerror(p.error));
+		ok = false;
+	}
+
+	if(sum) *sum = p.sum;
+	log_vmsg("+ dump_tab: %s\n", ok ? "ok!" : "failed");
+	return ok;
+}
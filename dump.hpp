@@ -0,0 +1,38 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef DUMP_INCLUDED
+#define DUMP_INCLUDED
+
+#include <stdint.h>
+#include <string>
+
+// Dump the table p2 of database p1 to the file `fname', as the header
+// line followed by all the table rows in the sql2text text format.
+// Fetching rows from the database, encoding them and writing them to
+// the file run as three pipelined stages, connected by bounded queues
+// of row batches, so that database latency, encoding and disk writes
+// overlap. If sum is given, the writing stage sets it to a checksum of
+// the contents of the file, the same for the same contents, so that the
+// file need not be read again to tell whether it has changed. Returns
+// false on failure.
+bool dump_tab(const char* p1, const char* p2, const std::string& header,
+	const std::string& fname, uint64_t* sum = NULL);
+
+#endif
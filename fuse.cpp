@@ -30,7 +30,15 @@
 */
 
 #include "sql2textfs.hpp"
-#include "pstream.h"
+#include "dump.hpp"
+#include "commit.hpp"
+#include "writeback.hpp"
+#include "journal.hpp"
+#include "rowdiff.hpp"
+
+// The fuse private data and the database connection of the thread
+fs_state* fs_private = NULL;
+__thread db_conn* fs_thread_db = NULL;
 
 // This is the mode that is used for mkdir in the temporary
 // directory.
@@ -59,23 +67,34 @@ struct monolock {
 };
 
 // Read a whole table from the database to a temporary file
-bool readtab(const char * p1, const char * p2)
+bool readtab(const char * p1, const char * p2, fs_file* f)
 {
 	log_vmsg("+ readtab(%s, %s)\n", p1, p2);
 
 	using namespace std;
 	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+	// the snapshot is held on the main connection
+	if(db == b) snap_check();
 	try {
 		log_vmsg("+ + readtab running ls_tabh\n");
-		std::string sx=b->h->ls_tabh(p1, p2);
+		std::string sx=db->h->ls_tabh(p1, p2);
 		if(sx.size()==0) return false;
 		log_vmsg("+ + readtab ls_tabh: ok!\n");
-		ofstream of((std::string(b->rootdir) + "/" + p1 + "/" + p2).c_str());
-		if(!of.good()) return false;
-		log_vmsg("+ + readtab running cat_tab\n");
-		of << sx << std::endl;
-		b->h->cat_tab(p1, p2, of);
-		log_vmsg("+ + readtab cat tab: ok!\n");
+		// the version is read first: a change between the two is then
+		// taken as a change since the dump
+		if(f && b->merge) f->version = tab_version(p1, p2, sx);
+		log_vmsg("+ + readtab running dump_tab\n");
+		// the kernel keeps its pages of a file that is read unchanged
+		std::string fname = std::string(b->rootdir) + "/" + p1 + "/" + p2;
+		uint64_t sum = 0;
+		if(!dump_tab(p1, p2, sx, fname, f ? &sum : NULL))
+			return false;
+		// the contents are the same if the file has not been written
+		// since it was last read and the rows read are the same
+		if(f && (f->gen != f->sumgen || f->sum != sum)) f->gen++;
+		if(f) { f->sum = sum; f->sumgen = f->gen; }
+		log_vmsg("+ + readtab dump_tab: ok!\n");
 	}
 	catch(...) {
 		return false;
@@ -84,7 +103,6 @@ bool readtab(const char * p1, const char * p2)
 	return true;
 }
 
-#define DBCLONEEXT ".o"
 // Check if filename contains an invalid sequence
 // for example, ".o" is reserved for the db clones
 inline bool checkdot(const char* path)
@@ -102,165 +120,38 @@ inline bool fexist(const char* s)
 }
 
 // Make a clone of a table's temporary file to file with extension .o
+// The clone is written aside and renamed over the old one, which stays
+// whole for the journal entries that are linked to it. With the journal
+// it is synced as it is written, before any entry links it.
 bool copytab(const char * p1, const char * p2)
 {
 	log_vmsg("+ copytab(%s, %s)\n", p1, p2);
 
-	using namespace std;
-	fs_state* b = FS_DATA;
-	ifstream ff((std::string(b->rootdir) + "/" + p1 + "/" + p2).c_str());
-	if(!ff.good()) return false;
-	ofstream of((std::string(b->rootdir) + "/" + p1 + "/" + p2 + DBCLONEEXT).c_str());
-	if(!of.good()) return false;
-	of << ff.rdbuf();
-	/*while(ff.good() && !ff.eof()) {
-	ff.read
-	}*/
-	return true;
-}
-
-// Create a new table from data in file `from`, p1=db, p2=table name
-bool run_create(const char *from, const char* p1, const char* p2)
-{
-	log_vmsg("+ run_create(%s, %s, %s)\n",from,p1,p2);
-
 	fs_state* b = FS_DATA;
-
-	std::ifstream is(from);
-	std::string line;
-
-	if(std::getline(is, line)) {
-		log_vmsg("+ + creating table with: %s\n",line.c_str());
-		b->h->mk_tab(p1, p2, line);
-		log_vmsg("+ + created table.\n");
-	}
-	else return false;
-
-	sql2text::tbl info;
-	try{
-		b->h->info_tab(info, p1, p2);
-	}
-	catch(retranse::rtex& r)
-	{
-		log_vmsg("+ + crerr_retranse!!:%s:@%s/%s\n",from,p1,p2);
-		return false;
-	}
-	catch(std::exception& r)
-	{
-		log_vmsg("+ + crerr_std!!:%s:@%s/%s==%s\n",from,p1,p2,r.what());
-		return false;
-	}
-	catch(...)
-	{
-		log_vmsg("+ + crerr!!:%s:@%s/%s\n",from,p1,p2);
-		return false;
-	}
-
-	while (std::getline(is, line)) {
-		log_vmsg("+ + create line=%s\n",line.c_str());
-		//of << line << std::endl;
-		b->h->add_tab_row(info, p1, p2, line.c_str());
-		log_vmsg("+ + create line_end=%s\n",line.c_str());
-	}
-	log_msg("+ run_create: ok!\n");
-
-	return true;
-}
-
-// Execute `diff' to find modified lines. Apply modifications to database.
-// Return true if there have been modifications and they are applied.
-// from, to: temporary files to check with diff. p1=db, p2=table name
-bool exec_diff(const char *from, const char *to, const char* p1, const char* p2)
-{
-	log_vmsg("+ exec_diff(%s, %s, %s, %s)\n",from,to,p1,p2);
-	/*
-	   //redi::ipstream proc("./some_command", redi::pstreams::pstderr);
-	  std::string line;
-	  // read child's stdout
-	  while (std::getline(proc.out(), line))
-		std::cout << "stdout: " << line << 'n';
-	  // read child's stderr
-	  while (std::getline(proc.err(), line))
-		std::cout << "stderr: " << line << 'n';
-	*/
-	/*
-	   fs_state* b = FS_DATA;
-
-	   std::vector<std::string> arg;
-	   arg.push_back(from);
-	   arg.push_back(to);
-	   redi::ipstream is("/usr/bin/diff", arg);
-	   std::string line;
-	   std::ofstream of((std::string(b->rootdir) + "/" + p1 + "/" + p2 + ".po").c_str());
-	   while (std::getline(is, line)) {
-		log_msg("line=%s\n",line.c_str());
-		 of << line << std::endl;
-	   }
-	*/
-	fs_state* b = FS_DATA;
-
-	// Execution of `diff'
-	std::vector<std::string> arg;
-	arg.push_back("/usr/bin/diff");
-	arg.push_back(from);
-	arg.push_back(to);
-	redi::ipstream is("/usr/bin/diff", arg);
-	std::string line;
-
-	// Get table info
-	sql2text::tbl info;
-	try{
-		b->h->info_tab(info, p1, p2);
-	}
-	catch(retranse::rtex& r)
-	{
-		log_vmsg("+ + differr_retranse!!:%s:%s@%s/%s\n",from,to,p1,p2);
-		return false;
-	}
-	catch(std::exception& r)
-	{
-		log_vmsg("+ + differr_std!!:%s:%s@%s/%s==%s\n",from,to,p1,p2,r.what());
-		return false;
-	}
-	catch(...)
-	{
-		log_vmsg("+ + differr!!:%s:%s@%s/%s\n",from,to,p1,p2);
-		return false;
-	}
-
-	// Update different lines:
-	int ch=0;
-	while (std::getline(is, line)) {
-		log_vmsg("+ + diff line=%s\n",line.c_str());
-		//of << line << std::endl;
-		if(line.size()>=2 && line[0]=='<')
-			{ ch++; b->h->add_tab_row(info, p1, p2, line.c_str()+2); }
-		if(line.size()>=2 && line[0]=='>')
-			{ ch++; b->h->rm_tab_row(info, p1, p2, line.c_str()+2); }
-		log_vmsg("+ + diff line_end=%s\n",line.c_str());
-	}
-	log_vmsg("+ exec_diff: ok!\n");
-
-	if(ch) return true;
-	return false;
-	// true if diff
-	return true;
+	std::string fpath = std::string(b->rootdir) + "/" + p1 + "/" + p2;
+	return clone_copy(fpath.c_str(), (fpath + DBCLONEEXT).c_str(),
+		(std::string(b->rootdir) + PRIVDIR).c_str(), b->journal != NULL);
 }
 
 bool existance(const char* path, const char* tmpname, const char* reldir, const char* fname, int& retstat, const char* error_str)
 {
+	// a running commit of the file comes first
+	wb_wait(path);
+
 	if(!fexist(tmpname)) {
-		if(!readtab(reldir, fname))
+		if(!readtab(reldir, fname, &FS_DATA->files[path]))
 			{ return (false); }
 		else if(!copytab(reldir, fname))
 			{ retstat = fs_error(error_str); return (false); }
 	} else { // exists, test for reload trial
-		if(FS_DATA->reload && !FS_DATA->openfiles[path])
+		// a file with a queued commit holds writes that are not yet
+		// in the database
+		if(FS_DATA->reload && !FS_DATA->openfiles[path] && !wb_queued(path))
 		{
 			if(fexist((std::string(tmpname)+DBCLONEEXT).c_str())) //(was on database, not pseudo-file)
 			{
 				// probably safe to reload this file...
-				if(!readtab(reldir, fname))
+				if(!readtab(reldir, fname, &FS_DATA->files[path]))
 					{ return (false); }
 				else if(!copytab(reldir, fname))
 					{ retstat = fs_error(error_str); return (false); }
@@ -382,6 +273,7 @@ int fs_mkdir(const char *path, mode_t mode)
 	fs_state* b = FS_DATA;
 
 	try {
+		snap_end();
 		b->h->mk_db(path+1);
 	}
 	catch(retranse::rtex& e) // if fail to create database
@@ -414,6 +306,7 @@ int fs_rmdir(const char *path)
 	log_vmsg("\n");
 	log_msg("fs_rmdir(path=\"%s\")\n", path);
 	fs_fullpath(fpath, path);
+	wb_flush(path, true);
 
 	retstat = rmdir(fpath);
 	if (retstat < 0)
@@ -423,6 +316,8 @@ int fs_rmdir(const char *path)
 
 	try {
 
+		snap_end();
+		b->stmts->drop_db(path+1);
 		b->h->rm_db(path+1);
 
 	}catch(...) // if fail to delete database
@@ -451,6 +346,10 @@ int fs_unlink(const char *path)
 	log_vmsg("\n");
 	log_msg("fs_unlink(path=\"%s\")\n", path);
 	fs_fullpath(fgpath, path);
+	// a queued commit of the file is dropped, along with its journal
+	// entry, which would create the table again on the next mount
+	wb_take(path);
+	jr_done(path);
 
 	retstat = lstat(fgpath, &statbuf);
 
@@ -466,6 +365,8 @@ int fs_unlink(const char *path)
 			if(fexist((std::string(fgpath)+DBCLONEEXT).c_str())) {
 
 				// do only remove from database if clone file is present
+				snap_end();
+				b->stmts->drop(fpath, fpath+(sx-path));
 				b->h->rm_tab(fpath, fpath+(sx-path));
 
 				unlink((std::string(fgpath)+DBCLONEEXT).c_str());
@@ -479,6 +380,7 @@ int fs_unlink(const char *path)
 	retstat = unlink(fgpath);
 	if (retstat < 0)
 		retstat = fs_error("fs_unlink unlink");
+	FS_DATA->files.erase(path);
 
 	ml.unlock();
 	return retstat;
@@ -500,6 +402,8 @@ int fs_rename(const char *path, const char *newpath)
 
 	log_vmsg("\n");
 	log_msg("fs_rename(fpath=\"%s\", newpath=\"%s\")\n", path, newpath);
+	wb_flush(path);
+	wb_flush(newpath);
 
 	fs_state* b = FS_DATA;
 
@@ -534,6 +438,9 @@ int fs_rename(const char *path, const char *newpath)
 
 			log_vmsg("+ fs_rename mv_tab %s %s %s \n", fpath, fpath+(sx-path), newpath+1+(sx-path));
 
+			snap_end();
+			b->stmts->drop(fpath, fpath+(sx-path));
+			b->stmts->drop(fpath, newpath+1+(sx-path));
 			b->h->mv_tab(fpath, fpath+(sx-path), newpath+1+(sx-path));
 
 
@@ -543,6 +450,7 @@ int fs_rename(const char *path, const char *newpath)
 			retstat = rename(fpath, fnewpath);
 			if (retstat < 0)
 				retstat = fs_error("fs_rename rename");
+			b->files.erase(path);
 
             strcat(fpath, DBCLONEEXT);
             strcat(fnewpath, DBCLONEEXT);
@@ -588,11 +496,55 @@ int fs_truncate(const char *path, off_t newsize)
 	log_vmsg("\n");
 	log_msg("fs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
 	fs_fullpath(fpath, path);
+	wb_wait(path);
+
+	struct stat statbuf;
+	off_t oldsize = lstat(fpath, &statbuf) ? 0 : statbuf.st_size;
 
 	retstat = truncate(fpath, newsize);
 	if (retstat < 0)
 		fs_error("fs_truncate truncate");
-	//TODO: data changing eval.
+	else
+		track_truncate(path, oldsize, newsize);
+
+	ml.unlock();
+	return retstat;
+}
+
+/**
+ * Change the size of an open file
+ *
+ * This method is called instead of the truncate() method if the
+ * truncation was invoked from an ftruncate() system call.
+ *
+ * Introduced in version 2.5
+ */
+int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+	monolock ml;
+	ml.lock();
+	int retstat = 0;
+
+	log_vmsg("\n");
+	log_msg("fs_ftruncate(path=\"%s\", offset=%lld, fi=0x%08x)\n", path, offset, fi);
+	log_fi(fi);
+
+	// a private copy is truncated, and its truncation tracked, on its own
+	std::map<uint64_t, fs_copy>& cp = FS_DATA->copies;
+	std::map<uint64_t, fs_copy>::iterator c = cp.find(fi->fh);
+	if(c == cp.end()) {
+		ml.unlock();
+		return fs_truncate(path, offset);
+	}
+
+	struct stat statbuf;
+	off_t oldsize = fstat(fi->fh, &statbuf) ? 0 : statbuf.st_size;
+
+	retstat = ftruncate(fi->fh, offset);
+	if (retstat < 0)
+		retstat = fs_error("fs_ftruncate ftruncate");
+	else
+		track_truncate(c->second.f, oldsize, offset);
 
 	ml.unlock();
 	return retstat;
@@ -619,6 +571,80 @@ int fs_utime(const char *path, struct utimbuf *ubuf)
 	return retstat;
 }
 
+// Open a private copy of table file `path', whose baseline clone is
+// `clone', for handle fi
+static int copy_open(const char* path, const char* clone, struct fuse_file_info *fi)
+{
+	fs_state* b = FS_DATA;
+	int retstat = 0;
+
+	std::string tmp = std::string(b->rootdir) + PRIVDIR + "/copy-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if(fd < 0)
+		return fs_error("copy_open mkstemp");
+	bool ok = fs_copyfile(clone, fd);
+	close(fd);
+	// the copy has a clone of its own, which its commits append to
+	if(!ok || !clone_copy(clone, (tmp + DBCLONEEXT).c_str(),
+		(std::string(b->rootdir) + PRIVDIR).c_str())) {
+		retstat = fs_error("copy_open copy");
+		unlink(tmp.c_str());
+		return retstat;
+	}
+
+	fd = open(tmp.c_str(), fi->flags & ~(O_CREAT | O_EXCL));
+	if(fd < 0) {
+		retstat = fs_error("copy_open open");
+		unlink(tmp.c_str());
+		unlink((tmp + DBCLONEEXT).c_str());
+		return retstat;
+	}
+	log_msg("+ copy_open: private copy %s\n", tmp.c_str());
+
+	fs_copy& c = b->copies[fd];
+	c.path = path;
+	c.tmp = tmp;
+	c.append = (fi->flags & O_APPEND) != 0;
+	track_reset(c.f, tmp.c_str());
+	c.f.version = b->files[path].version;
+	if(fi->flags & O_TRUNC)
+		track_truncate(c.f, c.f.base, 0);
+
+	fi->fh = fd;
+	// the pages of the copy are not those of the table file
+	fi->direct_io = 1;
+	log_fi(fi);
+	return 0;
+}
+
+// Commit private copy c. Returns 1 if the database has been changed,
+// 0 if not, or -1 if the commit failed.
+static int copy_commit(fs_copy& c)
+{
+	const char* sx = strchr(c.path.c_str()+1, '/');
+	std::string p1(c.path.c_str()+1, sx), p2(sx+1);
+	try {
+		return commit_tab(&c.f, c.tmp.c_str(), p1.c_str(), p2.c_str()) ? 1 : 0;
+	}
+	catch(...) {
+		log_msg("    ERROR copy_commit: cannot commit the private copy %s\n", c.tmp.c_str());
+		return -1;
+	}
+}
+
+// Make private copy c its own baseline, once it has been committed. The
+// version of the table is then not known, as the commit may have merged
+// it with the changes of others.
+static bool copy_rebase(fs_copy& c)
+{
+	if(!clone_copy(c.tmp.c_str(), (c.tmp + DBCLONEEXT).c_str(),
+		(std::string(FS_DATA->rootdir) + PRIVDIR).c_str()))
+		return false;
+	track_reset(c.f, c.tmp.c_str());
+	c.f.version.clear();
+	return true;
+}
+
 /** File open operation
  *
  * No creation, or truncation flags (O_CREAT, O_EXCL, O_TRUNC)
@@ -657,6 +683,21 @@ int fs_open(const char *path, struct fuse_file_info *fi)
 
 		fs_fullpath(fpath, path);
 
+		// a writer of a file that is open gets a private copy
+		std::string clone = std::string(fpath) + DBCLONEEXT;
+		if(FS_DATA->priv && (fi->flags & O_ACCMODE) != O_RDONLY
+			&& FS_DATA->openfiles[path] && fexist(clone.c_str()))
+			return copy_open(path, clone.c_str(), fi);
+
+		// the kernel keeps the pages it has cached of the file, unless
+		// the file has been read again with changes since they were
+		fs_file& tf = FS_DATA->files[path];
+		fi->keep_cache = tf.cached == tf.gen;
+		tf.cached = tf.gen;
+
+		struct stat statbuf;
+		off_t oldsize = lstat(fpath, &statbuf) ? 0 : statbuf.st_size;
+
 		fd = open(fpath, fi->flags);
 		if (fd < 0)
 			retstat = fs_error("fs_open open");
@@ -664,7 +705,13 @@ int fs_open(const char *path, struct fuse_file_info *fi)
 		fi->fh = fd;
 		log_fi(fi);
 
-		FS_DATA->openfiles[path]++;
+		// the writes of a file with a queued commit are still to be
+		// committed along with the new ones
+		if(!FS_DATA->openfiles[path]++ && !wb_queued(path))
+			track_reset(path, fgpath);
+		// with atomic_o_trunc, the file is truncated by the open
+		if(fd >= 0 && (fi->flags & O_TRUNC))
+			track_truncate(path, oldsize, 0);
 
 		ml.unlock();
 		return 0;
@@ -728,6 +775,46 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_
 }
 
 
+/** Store data from an open file in a buffer
+ *
+ * Similar to the read() method, but data is stored and returned in
+ * a generic buffer.  No actual copying of data has to take place,
+ * the source file descriptor may simply be stored in the buffer for
+ * later data transfer.  The buffer must be allocated dynamically and
+ * freed by the caller.
+ *
+ * Introduced in version 2.9
+ */
+// The buffer is the temporary file itself, which fuse splices to the
+// kernel without copying it through user space.
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	monolock ml;
+	ml.lock();
+
+	log_vmsg("\n");
+	log_msg("fs_read_buf(path=\"%s\", bufp=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+		path, bufp, size, offset, fi);
+	log_fi(fi);
+
+	struct fuse_bufvec* buf = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+	if(!buf) return -ENOMEM;
+	buf->count = 1;
+	buf->idx = 0;
+	buf->off = 0;
+	buf->buf[0].size = size;
+	buf->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	buf->buf[0].mem = NULL;
+	buf->buf[0].fd = fi->fh;
+	buf->buf[0].pos = offset;
+	*bufp = buf;
+
+	ml.unlock();
+	return 0;
+}
+
+
 /** Write data to an open file
  *
  * Write should return exactly the number of bytes requested
@@ -751,9 +838,75 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset,
 	// no need to get fpath on this one, since I work from fi->fh not the path
 	log_fi(fi);
 
+	// a private copy opened for appending is written at its own end,
+	// which is not the end of the table file that the kernel knows of
+	std::map<uint64_t, fs_copy>& cp = FS_DATA->copies;
+	std::map<uint64_t, fs_copy>::iterator c = cp.find(fi->fh);
+	struct stat statbuf;
+	if(c != cp.end() && c->second.append && !fstat(fi->fh, &statbuf))
+		offset = statbuf.st_size;
+
 	retstat = pwrite(fi->fh, buf, size, offset);
 	if (retstat < 0)
 		retstat = fs_error("fs_write pwrite");
+	else if(c != cp.end())
+		track_write(c->second.f, offset, retstat);
+	else
+		track_write(path, offset, retstat);
+
+	ml.unlock();
+	return retstat;
+}
+
+/** Write contents of buffer to an open file
+ *
+ * Similar to the write() method, but data is supplied in a
+ * generic buffer.  Use fuse_buf_copy() to transfer data to
+ * the destination.
+ *
+ * Introduced in version 2.9
+ */
+// The buffer is copied to the temporary file by fuse_buf_copy, which
+// splices it from /dev/fuse when it is still there.
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi)
+{
+	monolock ml;
+	ml.lock();
+	int retstat = 0;
+	size_t size = fuse_buf_size(buf);
+
+	log_vmsg("\n");
+	log_msg("fs_write_buf(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n",
+		path, buf, size, offset, fi);
+	log_fi(fi);
+
+	// a private copy opened for appending is written at its own end
+	std::map<uint64_t, fs_copy>& cp = FS_DATA->copies;
+	std::map<uint64_t, fs_copy>::iterator c = cp.find(fi->fh);
+	struct stat statbuf;
+	if(c != cp.end() && c->second.append && !fstat(fi->fh, &statbuf))
+		offset = statbuf.st_size;
+
+	struct fuse_bufvec dst;
+	dst.count = 1;
+	dst.idx = 0;
+	dst.off = 0;
+	dst.buf[0].size = size;
+	dst.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+	dst.buf[0].mem = NULL;
+	dst.buf[0].fd = fi->fh;
+	dst.buf[0].pos = offset;
+
+	retstat = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+	if (retstat < 0) {
+		errno = -retstat;
+		retstat = fs_error("fs_write_buf fuse_buf_copy");
+	}
+	else if(c != cp.end())
+		track_write(c->second.f, offset, retstat);
+	else
+		track_write(path, offset, retstat);
 
 	ml.unlock();
 	return retstat;
@@ -830,6 +983,69 @@ int fs_flush(const char *path, struct fuse_file_info *fi)
 
 
 
+// Mark the pages that the kernel has cached of table file `path' stale,
+// once the file has been read again with changes while it is open. A
+// file that is not open has its pages dropped by its next open instead.
+// The write-back worker only commits files that are not open.
+static void fs_stale(const char* path, fs_file* f)
+{
+	fs_state* b = FS_DATA;
+	if(!f || f->gen == f->cached || FS_DB != b || b->openfiles[path] <= 0)
+		return;
+	std::map<std::string, fuse_ino_t>::iterator i = b->inos.find(path);
+	if(i != b->inos.end()) b->stale.push_back(i->second);
+	f->cached = f->gen;
+}
+
+// Commit a table file to the database: the changes of a file that is
+// read from the database, or the creation of a new table. If the
+// database has changed, the file and its clone are read again.
+int fs_commit(const char* path, fs_file* f)
+{
+	int retstat = 0;
+	char fpath[PATH_MAX];
+	char fgpath[PATH_MAX];
+	const char* sx = strchr(path+1,'/');
+
+	strcpy(fpath,path+1);
+	fpath[sx-path-1]=0;
+	fs_fullpath(fgpath, path);
+
+	try {
+		bool rv;
+		if(fexist((std::string(fgpath)+DBCLONEEXT).c_str()))
+			rv=commit_tab(f, fgpath, fpath, fpath+(sx-path));
+		else
+			rv=run_create(fgpath, fpath, fpath+(sx-path));
+		jr_done(path);
+
+		if(rv) {
+			if(!readtab(fpath, fpath+(sx-path), f))
+				return (retstat = fs_error("fs_commit read db error"));
+			if(!copytab(fpath, fpath+(sx-path)))
+				return (retstat = fs_error("fs_commit copy error"));
+			if(f) track_reset(*f, fgpath);
+			else track_reset(path, fgpath);
+			fs_stale(path, f);
+		}
+		return retstat;
+	}
+	catch(...)
+	{
+		log_vmsg("+ fs_commit diff exception\n");
+		// the writes are dropped along with the file
+		jr_done(path);
+		if(!readtab(fpath, fpath+(sx-path), f))
+			return (retstat = fs_error("fs_commit read error after exception"));
+		if(!copytab(fpath, fpath+(sx-path)))
+			return (retstat = fs_error("fs_commit copy error after exception"));
+		if(f) track_reset(*f, fgpath);
+		else track_reset(path, fgpath);
+		fs_stale(path, f);
+		return retstat = -1;
+	}
+}
+
 /** Release an open file
  *
  * Release is called when there are no more references to an open
@@ -849,9 +1065,7 @@ int fs_release(const char *path, struct fuse_file_info *fi)
 	monolock ml;
 	ml.lock();
 	int retstat = 0;
-	char fpath[PATH_MAX];
-	char fgpath[PATH_MAX];
-	const char* sx;
+	fs_state* b = FS_DATA;
 
 	log_vmsg("\n");
 	log_msg("fs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
@@ -860,67 +1074,55 @@ int fs_release(const char *path, struct fuse_file_info *fi)
 	// We need to close the file.  Had we allocated any resources
 	// (buffers etc) we'd need to free them here as well.
 	retstat = close(fi->fh);
-	FS_DATA->openfiles[path]--;
-	//return retstat;
-
-	fs_fullpath(fpath, path);
-
-	try {
-		retstat = 1;//lstat(fpath, statbuf);
 
-		if(retstat != 0 && path[0] && (sx=strchr(path+1,'/')) && !checkdot(path)) {
-			strcpy(fpath,path+1);
-			fpath[sx-path-1]=0;
+	std::map<uint64_t, fs_copy>::iterator c = b->copies.find(fi->fh);
+	if(c != b->copies.end()) {
+		// a private copy is committed and removed
+		fs_copy cp = c->second;
+		b->copies.erase(c);
+		snap_end();
+		int rv = copy_commit(cp);
+		unlink(cp.tmp.c_str());
+		unlink((cp.tmp + DBCLONEEXT).c_str());
+
+		// the table file is read again, unless it is in use
+		const char* sx = strchr(path+1, '/');
+		std::string p1(path+1, sx);
+		if(rv > 0 && !b->openfiles[path] && !wb_queued(path)) {
+			char fgpath[PATH_MAX];
 			fs_fullpath(fgpath, path);
+			if(readtab(p1.c_str(), sx+1, &b->files[path])
+				&& copytab(p1.c_str(), sx+1))
+				track_reset(path, fgpath);
+		}
+		return rv < 0 ? -1 : 0;
+	}
+	b->openfiles[path]--;
 
-			if(fexist((std::string(fgpath)+DBCLONEEXT).c_str())) {
-
-				bool rv=exec_diff(fgpath, (std::string(fgpath)+".o").c_str(), fpath, fpath+(sx-path));
-				//if(!fexist(fgpath))
-				if(rv) {
-					if(!readtab(fpath, fpath+(sx-path)))
-						return (retstat = fs_error("fs_release read db error"));
-					//if(!fexist((std::string(fgpath)+".o").c_str()))
-					if(!copytab(fpath, fpath+(sx-path)))
-						return (retstat = fs_error("fs_release copy error"));
-
-				}
-
-				//if(!rv)
-				//	return retstat = -1;
-			} else {
-				bool rv=run_create(fgpath, fpath, fpath+(sx-path));
-				if(rv) {
-					if(!readtab(fpath, fpath+(sx-path)))
-						return (retstat = fs_error("fs_release read db error after creation"));
-					//if(!fexist((std::string(fgpath)+".o").c_str()))
-					if(!copytab(fpath, fpath+(sx-path)))
-						return (retstat = fs_error("fs_release copy error"));
-
-				}
+	if(path[0] && strchr(path+1,'/') && !checkdot(path)) {
+		// writing to the database ends any snapshot
+		snap_end();
 
-			}
+		std::map<std::string, fs_file>::iterator it = b->files.find(path);
+		fs_file* f = it == b->files.end() ? NULL : &it->second;
 
-			//no: if(!readtab(fpath, fpath+(sx-path))) return (retstat = fs_error("fs_open error"));
-			//if(!copytab(fpath, fpath+(sx-path))) return (retstat = fs_error("fs_open error"));
+		// the writes are saved before they are committed
+		char fgpath[PATH_MAX];
+		fs_fullpath(fgpath, path);
+		jr_write(path, fgpath, f);
 
+		// the file is committed by the worker, once it is closed, if
+		// it has been written to
+		if(b->async && f) {
+			if(track_written(*f, fgpath)) wb_queue(path);
+			return 0;
 		}
-
-		retstat = 0;
-
-		ml.unlock();
-		return retstat;
-	}
-	catch(...)
-	{
-		log_vmsg("+ fs_release diff exception\n");
-		if(!readtab(fpath, fpath+(sx-path)))
-			return (retstat = fs_error("fs_release read error after exception"));
-		if(!copytab(fpath, fpath+(sx-path)))
-			return (retstat = fs_error("fs_release copy error after exception"));
-		ml.unlock();
-		return retstat = -1; //fs_error("fs_rename rename");
+		retstat = fs_commit(path, f);
 	}
+	else retstat = 0;
+
+	ml.unlock();
+	return retstat;
 }
 
 /** Synchronize file contents
@@ -950,8 +1152,64 @@ int fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 	} else
 		retstat = fsync(fi->fh);
 
+	std::map<uint64_t, fs_copy>& cp = FS_DATA->copies;
+	std::map<uint64_t, fs_copy>::iterator c = cp.find(fi->fh);
+
 	if (retstat < 0)
 		fs_error("fs_fsync fsync");
+	else if(c != cp.end()) {
+		// a private copy is committed, and is its own baseline after
+		snap_end();
+		int rv = copy_commit(c->second);
+		if(rv < 0) retstat = -1;
+		else if(rv > 0 && !copy_rebase(c->second))
+			retstat = fs_error("fs_fsync rebase");
+	}
+	else if(path[0] && strchr(path+1,'/') && !checkdot(path)) {
+		// the changes of a table file are durable once they are in
+		// the database: they are committed now, along with those of
+		// any queued commit of the file
+		fs_state* b = FS_DATA;
+		char fgpath[PATH_MAX];
+		snap_end();
+		wb_take(path);
+		std::map<std::string, fs_file>::iterator it = b->files.find(path);
+		fs_file* f = it == b->files.end() ? NULL : &it->second;
+		fs_fullpath(fgpath, path);
+		jr_write(path, fgpath, f);
+		retstat = fs_commit(path, f);
+	}
+
+	ml.unlock();
+	return retstat;
+}
+
+/** Set extended attributes
+ *
+ * Only FLUSH_XATTR is supported: setting it commits the table file, or
+ * all the table files under the directory, without waiting for their
+ * queued commits to be due.
+ */
+int fs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+	monolock ml;
+	ml.lock();
+	int retstat = 0;
+
+	log_vmsg("\n");
+	log_msg("fs_setxattr(path=\"%s\", name=\"%s\", size=%d, flags=0x%08x)\n",
+		path, name, size, flags);
+
+	if(strcmp(name, FLUSH_XATTR))
+		return -ENOTSUP;
+
+	if(!checkdot(path)) {
+		snap_end();
+		if(!strcmp(path, "/"))
+			retstat = wb_flush("", true);
+		else
+			retstat = wb_flush(path, !strchr(path+1, '/'));
+	}
 
 	ml.unlock();
 	return retstat;
@@ -1024,7 +1282,7 @@ int fs_opendir(const char *path, struct fuse_file_info *fi)
  *
  * Introduced in version 2.3
  */
-int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+int fs_readdir(const char *path, void *buf, fs_fill_t filler, off_t offset,
 	       struct fuse_file_info *fi)
 {
 	monolock ml;
@@ -1048,6 +1306,10 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
 
 	try{
 
+		// a directory listing starts a traversal, that reads all
+		// the tables from the same snapshot
+		if(buf) snap_begin();
+
 		if(!strcmp(path, "/")) { // root ls
 
 			b->v[k] = b->h->ls_root();
@@ -1224,11 +1486,37 @@ void *fs_init(struct fuse_conn_info *conn)
 	log_msg("fs_init()\n");
 
 	fuse_file_info a;
-	fuse_fill_dir_t filler=0;//if any problem occurs delete =0
+	fs_fill_t filler=0;//if any problem occurs delete =0
 	fs_opendir("/",&a);
 	fs_readdir("/",NULL,filler,0,&a);
 	fs_releasedir("/",&a);
 
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+	// a private copy is opened before it is truncated
+	if(FS_DATA->priv) conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+#endif
+
+#ifdef FUSE_CAP_SPLICE_WRITE
+	// reads are spliced from the temporary files to the kernel
+	conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+#endif
+#ifdef FUSE_CAP_SPLICE_READ
+	// and writes from the kernel to the temporary files
+	conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
+#endif
+#ifdef FUSE_CAP_BIG_WRITES
+	conn->want |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+	// writes are as large as the kernel sends them; libfuse lowers
+	// max_write to the size of its request buffer
+	conn->max_write = UINT_MAX;
+
+	// the commits that a crash left unfinished are done first
+	jr_replay();
+
+	// the worker is started here, after fuse has forked to background
+	wb_start();
+
 	return FS_DATA;
 }
 
@@ -1244,6 +1532,22 @@ void fs_destroy(void *userdata)
 	log_vmsg("\n");
 	log_msg("fs_destroy(userdata=0x%08x)\n", userdata);
 
+	monolock ml;
+	ml.lock();
+	wb_stop();
+	ml.unlock();
+	std::vector<db_conn*> conns(FS_DATA->pool);
+	conns.push_back(FS_DATA->wdb);
+	for(size_t i = 0; i < conns.size(); i++) {
+		if(!conns[i]) continue;
+		delete conns[i]->stmts;
+		delete conns[i]->h;
+		delete conns[i]->sql;
+		delete conns[i];
+	}
+
+	snap_end();
+	delete FS_DATA->stmts;
 	delete FS_DATA->h;
 	//rmdir (FS_DATA->rootdir);
 	tool::rdel (FS_DATA->rootdir);
@@ -0,0 +1,285 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include "commit.hpp"
+#include "journal.hpp"
+
+// Flush the directory entries of directory dir to disk
+static void jr_syncdir(const std::string& dir)
+{
+	int fd = open(dir.c_str(), O_RDONLY);
+	if(fd < 0) return;
+	fsync(fd);
+	close(fd);
+}
+
+// Write n bytes at s to fd. Returns false on error.
+static bool jr_put(int fd, const char* s, size_t n)
+{
+	while(n) {
+		ssize_t w = write(fd, s, n);
+		if(w < 0 && errno == EINTR) continue;
+		if(w <= 0) return false;
+		s += w;
+		n -= w;
+	}
+	return true;
+}
+
+// Write the written ranges of file fgpath, of the given size, to fd in
+// the format of a journal entry
+static bool jr_ranges(int fd, const char* fgpath, off_t base, off_t size,
+	const std::map<off_t, off_t>& d)
+{
+	int in = open(fgpath, O_RDONLY);
+	if(in < 0) return false;
+	char line[64];
+	sprintf(line, "%lld %lld\n", (long long) base, (long long) size);
+	bool ok = jr_put(fd, line, strlen(line));
+
+	std::vector<char> buf(1 << 20);
+	std::map<off_t, off_t>::const_iterator it;
+	for(it = d.begin(); ok && it != d.end(); ++it) {
+		off_t s = it->first, e = it->second < size ? it->second : size;
+		if(s >= e) continue;
+		sprintf(line, "%lld %lld\n", (long long) s, (long long) (e - s));
+		ok = jr_put(fd, line, strlen(line));
+		while(ok && s < e) {
+			size_t n = e - s < (off_t) buf.size() ? e - s : buf.size();
+			ssize_t r = pread(in, &buf[0], n, s);
+			ok = r > 0 && jr_put(fd, &buf[0], r);
+			s += r;
+		}
+	}
+	close(in);
+	return ok;
+}
+
+// Make `to' the baseline clone `clone' of an entry: a hard link, or a
+// copy if the journal is on another disk. The temporary directory is in
+// the journal directory, so the clone is on the same disk, and its data
+// was synced when it was written.
+static bool jr_clone(const std::string& clone, const std::string& to)
+{
+	if(!link(clone.c_str(), to.c_str())) return true;
+	if(errno != EXDEV) return false;
+
+	int fd = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0) return false;
+	bool ok = fs_copyfile(clone.c_str(), fd) && !fsync(fd);
+	close(fd);
+	return ok;
+}
+
+bool jr_write(const char* path, const char* fgpath, fs_file* f)
+{
+	fs_state* b = FS_DATA;
+	if(!b->journal) return true;
+	if(f && !track_written(*f, fgpath)) return true;
+
+	log_vmsg("+ jr_write(%s)\n", path);
+
+	std::string entry = std::string(b->journal) + path;
+	std::string dir = entry.substr(0, entry.rfind('/'));
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+	mkdir(dir.c_str(), 0700);
+
+	struct stat st;
+	if(stat(fgpath, &st)) {
+		fs_error("jr_write stat");
+		return false;
+	}
+	// the ranges written since the baseline, or the whole file
+	struct stat cst;
+	bool base = f && !stat(clone.c_str(), &cst);
+	std::map<off_t, off_t> d;
+	if(base) {
+		d = f->dirty;
+		if(st.st_size > f->base) d[f->base] = st.st_size;
+	}
+	else d[0] = st.st_size;
+
+	// the entry is written to temporary files and renamed over the
+	// previous entry of the file, which stays whole until then. The
+	// clone of an earlier entry is that of the same baseline, since an
+	// entry is removed when its baseline changes.
+	std::string tmp = std::string(b->journal) + "/.jr-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if(fd < 0) {
+		fs_error("jr_write mkstemp");
+		return false;
+	}
+	bool ok = jr_ranges(fd, fgpath, base ? f->base : -1, st.st_size, d) && !fsync(fd);
+	close(fd);
+	std::string tclone = tmp + DBCLONEEXT;
+	if(ok && base)
+		ok = jr_clone(clone, tclone) && !rename(tclone.c_str(), (entry + DBCLONEEXT).c_str());
+	if(ok && !base)
+		unlink((entry + DBCLONEEXT).c_str());
+	if(!ok || rename(tmp.c_str(), entry.c_str())) {
+		fs_error("jr_write write");
+		unlink(tmp.c_str());
+		unlink(tclone.c_str());
+		return false;
+	}
+	jr_syncdir(dir);
+	return true;
+}
+
+void jr_done(const char* path)
+{
+	fs_state* b = FS_DATA;
+	if(!b->journal) return;
+	std::string entry = std::string(b->journal) + path;
+	unlink(entry.c_str());
+	unlink((entry + DBCLONEEXT).c_str());
+}
+
+// Rebuild the file of journal entry `entry' in fd, from its baseline
+// clone and its written ranges. Sets base to false if it has no baseline.
+static bool jr_rebuild(const std::string& entry, int fd, bool& base)
+{
+	FILE* in = fopen(entry.c_str(), "r");
+	if(!in) return false;
+	long long bsize = -1, size = -1, off, len;
+	bool ok = fscanf(in, "%lld %lld", &bsize, &size) == 2 && fgetc(in) == '\n';
+	base = bsize >= 0;
+	if(ok && base) ok = fs_copyfile((entry + DBCLONEEXT).c_str(), fd);
+
+	std::vector<char> buf(1 << 20);
+	while(ok && fscanf(in, "%lld %lld", &off, &len) == 2) {
+		ok = fgetc(in) == '\n';
+		while(ok && len > 0) {
+			size_t n = len < (long long) buf.size() ? len : buf.size();
+			ok = fread(&buf[0], 1, n, in) == n && pwrite(fd, &buf[0], n, off) == (ssize_t) n;
+			off += n;
+			len -= n;
+		}
+	}
+	ok = ok && !ferror(in) && size >= 0 && !ftruncate(fd, size);
+	fclose(in);
+	return ok;
+}
+
+// Commit the journal entry of table file `path'
+static void jr_apply(const char* path)
+{
+	fs_state* b = FS_DATA;
+	char fgpath[PATH_MAX];
+	const char* sx = strchr(path+1, '/');
+	std::string p1(path+1, sx), p2(sx+1);
+	std::string entry = std::string(b->journal) + path;
+
+	log_msg("jr_replay(path=\"%s\")\n", path);
+	fs_fullpath(fgpath, path);
+
+	std::string tmp = std::string(b->rootdir) + "/.jr-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	bool base = false;
+	bool ok = fd >= 0 && jr_rebuild(entry, fd, base);
+	if(fd >= 0) close(fd);
+	// an entry that is not committed is kept for the next mount
+	if(!ok) {
+		fs_error("jr_replay read error");
+		unlink(tmp.c_str());
+		return;
+	}
+
+	std::string clone = std::string(fgpath) + DBCLONEEXT;
+	bool done = false;
+	try {
+		if(base)
+			// the rows that the writes add and remove are applied to
+			// the table
+			commit_delta(tmp.c_str(), (entry + DBCLONEEXT).c_str(),
+				p1.c_str(), p2.c_str());
+		else {
+			// a file without baseline is committed as a whole against
+			// the table as it is now in the database, or creates it
+			if(readtab(p1.c_str(), p2.c_str()) && !copytab(p1.c_str(), p2.c_str()))
+				throw std::runtime_error("cannot copy the table");
+			if(rename(tmp.c_str(), fgpath))
+				throw std::runtime_error("cannot write the table file");
+			if(!access(clone.c_str(), F_OK))
+				commit_tab(NULL, fgpath, p1.c_str(), p2.c_str());
+			else
+				run_create(fgpath, p1.c_str(), p2.c_str());
+		}
+		done = true;
+	}
+	// the database may have rejected the rows, or only failed to apply
+	// them for now, as on a lock wait timeout or a lost connection: the
+	// entry is kept and replayed again on the next mount
+	catch(std::exception& e) {
+		log_msg("    ERROR jr_replay: the writes of %s are kept for the next mount: %s\n",
+			path, e.what());
+	}
+	catch(retranse::rtex& e) {
+		log_msg("    ERROR jr_replay: the writes of %s are kept for the next mount: %s\n",
+			path, e.s.c_str());
+	}
+	unlink(tmp.c_str());
+	if(done) jr_done(path);
+
+	// a file left in the temporary directory is read again, or removed
+	// if its table is not in the database
+	if(access(fgpath, F_OK)) return;
+	if(readtab(p1.c_str(), p2.c_str(), &b->files[path]) && copytab(p1.c_str(), p2.c_str()))
+		track_reset(path, fgpath);
+	else {
+		unlink(fgpath);
+		unlink(clone.c_str());
+	}
+}
+
+void jr_replay()
+{
+	fs_state* b = FS_DATA;
+	if(!b->journal) return;
+
+	DIR* dp = opendir(b->journal);
+	if(!dp) { fs_error("jr_replay opendir"); return; }
+	std::vector<std::string> paths;
+	dirent* de;
+	while((de = readdir(dp)) != NULL) {
+		std::string dir = std::string(b->journal) + "/" + de->d_name;
+		// remove the temporary files of entries left unwritten, and
+		// the temporary directories of earlier mounts
+		if(!strncmp(de->d_name, ".jr-", 4)) { unlink(dir.c_str()); continue; }
+		if(!strncmp(de->d_name, ".tmp-", 5) && dir != b->rootdir)
+			{ tool::rdel(dir.c_str()); continue; }
+		if(de->d_name[0] == '.') continue;
+		DIR* tp = opendir(dir.c_str());
+		if(!tp) continue;
+		dirent* te;
+		while((te = readdir(tp)) != NULL) {
+			size_t n = strlen(te->d_name), x = strlen(DBCLONEEXT);
+			// the baseline clones go with their entries
+			if(n > x && !strcmp(te->d_name + n - x, DBCLONEEXT)) continue;
+			if(te->d_name[0] != '.')
+				paths.push_back(std::string("/") + de->d_name + "/" + te->d_name);
+		}
+		closedir(tp);
+	}
+	closedir(dp);
+
+	for(size_t i = 0; i < paths.size(); i++)
+		jr_apply(paths[i].c_str());
+}
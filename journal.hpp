@@ -0,0 +1,55 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef JOURNAL_INCLUDED
+#define JOURNAL_INCLUDED
+
+// Write-ahead journal of table file commits. Before a written table file
+// is committed, or queued for commit, its writes are saved in the journal
+// directory, and the entry is removed once the commit is done, whether
+// the database accepted it or not. An entry has two files:
+//   <db>/<table>    the bytes written since the baseline: a line with the
+//                   size of the baseline (-1 if there is none) and the
+//                   size of the file, then for each written range a line
+//                   with its offset and length followed by its bytes
+//   <db>/<table>.o  the baseline clone, as a hard link, since a linked
+//                   clone is not changed in place (see clone.hpp), or as
+//                   a copy on another disk
+// Saving an entry therefore costs the written bytes, not the table.
+// Entries left by a crash are replayed on the next mount: the file is
+// rebuilt from the baseline and the written ranges, and the rows it adds
+// to and removes from the baseline are applied to the table as it is
+// then, as the merge policy does, which keeps the changes of others. A
+// file without baseline is committed as a whole, and creates its table
+// if it is not there. An entry whose replay fails is kept for the next
+// mount, since the failure may not last, as a lock wait timeout or a lost
+// connection.
+
+// Save the writes of table file `path' at `fgpath', with write state f
+// (NULL if not tracked: the whole file is saved), to the journal, unless
+// nothing was written to it. Returns false on error.
+bool jr_write(const char* path, const char* fgpath, fs_file* f);
+
+// Remove the journal entry of table file `path'
+void jr_done(const char* path);
+
+// Commit the journal entries left by a previous mount
+void jr_replay();
+
+#endif
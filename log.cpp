@@ -81,7 +81,7 @@ void log_vmsg(const char *format, ...)
     
 // struct fuse_file_info keeps information about files (surprise!).
 // This dumps all the information in a struct fuse_file_info.  The struct
-// definition, and comments, come from /usr/include/fuse/fuse_common.h
+// definition, and comments, come from /usr/include/fuse3/fuse_common.h
 // Duplicated here for convenience.
 void log_fi (struct fuse_file_info *fi)
 {
@@ -90,13 +90,9 @@ void log_fi (struct fuse_file_info *fi)
 	//	int flags;
 	log_struct(fi, flags, 0x%08x, );
 
-	/** Old file handle, don't use */
-	//	unsigned long fh_old;	
-	log_struct(fi, fh_old, 0x%08lx,  );
-
 	/** In case of a write operation indicates if this was caused by a
 		writepage */
-	//	int writepage;
+	//	unsigned int writepage : 1;
 	log_struct(fi, writepage, %d, );
 
 	/** Can be filled in by open, to use direct I/O on this file.
@@ -0,0 +1,441 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+// The low-level fuse callbacks. The kernel names the nodes of the file
+// system by inode number; each callback finds the path of its inode in
+// the inode table and calls the path callback of fuse.cpp. A node is
+// added to the table when the kernel looks it up, and removed when the
+// kernel has forgotten all its lookups. The inode table is guarded by
+// the main mutex, which is not held while the path callback runs.
+
+#include "sql2textfs.hpp"
+
+// The inode number of the directory entries of unknown inodes, as the
+// high-level fuse library reports them
+#define UNKNOWN_INO 0xffffffff
+
+// Return the path of inode ino, or an empty string if it is not known
+static std::string node_path(fuse_ino_t ino)
+{
+	fs_state* b = FS_DATA;
+	pthread_mutex_lock(&b->lock);
+	std::map<fuse_ino_t, fs_node>::iterator n = b->nodes.find(ino);
+	std::string path = n != b->nodes.end() ? n->second.path : "";
+	pthread_mutex_unlock(&b->lock);
+	return path;
+}
+
+// Return the path of entry `name' of directory inode parent, or an empty
+// string if parent is not known
+static std::string entry_path(fuse_ino_t parent, const char* name)
+{
+	std::string path = node_path(parent);
+	if(path.empty()) return path;
+	if(path != "/") path += "/";
+	return path + name;
+}
+
+// Reply to req with the result ret of a path callback that has no data
+static void reply_ret(fuse_req_t req, int ret)
+{
+	fuse_reply_err(req, ret < 0 ? -ret : 0);
+}
+
+// Add a lookup of the node of `path' to the inode table and reply to req
+// with its entry
+static void reply_entry(fuse_req_t req, const std::string& path)
+{
+	fs_state* b = FS_DATA;
+	struct fuse_entry_param e;
+	memset(&e, 0, sizeof(e));
+
+	int ret = fs_getattr(path.c_str(), &e.attr);
+	if(ret < 0) { reply_ret(req, ret); return; }
+
+	pthread_mutex_lock(&b->lock);
+	fuse_ino_t& ino = b->inos[path];
+	if(!ino) {
+		ino = b->next_ino++;
+		b->nodes[ino].path = path;
+	}
+	b->nodes[ino].nlookup++;
+	e.ino = ino;
+	pthread_mutex_unlock(&b->lock);
+
+	e.attr.st_ino = e.ino;
+	e.attr_timeout = b->timeout;
+	e.entry_timeout = b->timeout;
+	fuse_reply_entry(req, &e);
+}
+
+// Remove nlookup lookups of inode ino, and the node once none is left
+static void forget_node(fuse_ino_t ino, uint64_t nlookup)
+{
+	fs_state* b = FS_DATA;
+	std::map<fuse_ino_t, fs_node>::iterator n = b->nodes.find(ino);
+	if(n == b->nodes.end() || ino == FUSE_ROOT_ID) return;
+	fs_node& node = n->second;
+	node.nlookup -= nlookup < node.nlookup ? nlookup : node.nlookup;
+	if(node.nlookup) return;
+
+	std::map<std::string, fuse_ino_t>::iterator i = b->inos.find(node.path);
+	if(i != b->inos.end() && i->second == ino) b->inos.erase(i);
+	b->nodes.erase(n);
+}
+
+// Remove `path' from the inode table, once its file is removed. Its node
+// keeps the path until the kernel forgets it, so that its open handles
+// are still released, and a new file of the same path gets a new node.
+static void unmap_node(const std::string& path)
+{
+	fs_state* b = FS_DATA;
+	pthread_mutex_lock(&b->lock);
+	b->inos.erase(path);
+	pthread_mutex_unlock(&b->lock);
+}
+
+// Tell the kernel to drop the cached pages of the inodes that were marked
+// stale by the commits of a callback, once it has replied, so that no
+// lock is held that dropping them could wait for
+static void inval_stale()
+{
+	fs_state* b = FS_DATA;
+	std::vector<fuse_ino_t> stale;
+	pthread_mutex_lock(&b->lock);
+	stale.swap(b->stale);
+	pthread_mutex_unlock(&b->lock);
+	for(size_t i = 0; i < stale.size(); i++)
+		fuse_lowlevel_notify_inval_inode(b->se, stale[i], 0, 0);
+}
+
+// The filler of fs_readdir. The entries are taken from the resource
+// handler of the directory handle instead.
+static int dir_skip(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+	return 0;
+}
+
+void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	fs_state* b = FS_DATA;
+	b->nodes[FUSE_ROOT_ID].path = "/";
+	b->inos["/"] = FUSE_ROOT_ID;
+	b->next_ino = FUSE_ROOT_ID + 1;
+
+	fs_init(conn);
+}
+
+void ll_destroy(void *userdata)
+{
+	fs_destroy(userdata);
+}
+
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	std::string path = entry_path(parent, name);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+	reply_entry(req, path);
+}
+
+void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup)
+{
+	fs_state* b = FS_DATA;
+	pthread_mutex_lock(&b->lock);
+	forget_node(ino, nlookup);
+	pthread_mutex_unlock(&b->lock);
+	fuse_reply_none(req);
+}
+
+void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+	fs_state* b = FS_DATA;
+	pthread_mutex_lock(&b->lock);
+	for(size_t i = 0; i < count; i++)
+		forget_node(forgets[i].ino, forgets[i].nlookup);
+	pthread_mutex_unlock(&b->lock);
+	fuse_reply_none(req);
+}
+
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	struct stat st;
+	int ret = fs_getattr(path.c_str(), &st);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, FS_DATA->timeout);
+}
+
+// Only the size and the times of a file can be set
+void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = 0;
+	struct stat st;
+	if(to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+		ret = -ENOSYS;
+
+	if(!ret && (to_set & FUSE_SET_ATTR_SIZE))
+		ret = fi ? fs_ftruncate(path.c_str(), attr->st_size, fi)
+			: fs_truncate(path.c_str(), attr->st_size);
+
+	if(!ret && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))
+		&& !(ret = fs_getattr(path.c_str(), &st))) {
+		struct utimbuf ubuf;
+		ubuf.actime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? time(NULL)
+			: (to_set & FUSE_SET_ATTR_ATIME) ? attr->st_atime : st.st_atime;
+		ubuf.modtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(NULL)
+			: (to_set & FUSE_SET_ATTR_MTIME) ? attr->st_mtime : st.st_mtime;
+		ret = fs_utime(path.c_str(), &ubuf);
+	}
+
+	if(!ret) ret = fs_getattr(path.c_str(), &st);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	st.st_ino = ino;
+	fuse_reply_attr(req, &st, FS_DATA->timeout);
+}
+
+void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+	std::string path = entry_path(parent, name);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_mknod(path.c_str(), mode, rdev);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	reply_entry(req, path);
+}
+
+void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	std::string path = entry_path(parent, name);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_mkdir(path.c_str(), mode);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	reply_entry(req, path);
+}
+
+void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	std::string path = entry_path(parent, name);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_unlink(path.c_str());
+	if(!ret) unmap_node(path);
+	reply_ret(req, ret);
+}
+
+void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	std::string path = entry_path(parent, name);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_rmdir(path.c_str());
+	if(!ret) unmap_node(path);
+	reply_ret(req, ret);
+	inval_stale();
+}
+
+// The node of the renamed file takes the new path
+void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags)
+{
+	if(flags) { fuse_reply_err(req, EINVAL); return; }
+
+	std::string path = entry_path(parent, name);
+	std::string newpath = entry_path(newparent, newname);
+	if(path.empty() || newpath.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_rename(path.c_str(), newpath.c_str());
+	if(ret < 0 || path == newpath) { reply_ret(req, ret); inval_stale(); return; }
+
+	unmap_node(newpath);
+
+	fs_state* b = FS_DATA;
+	pthread_mutex_lock(&b->lock);
+	std::map<std::string, fuse_ino_t>::iterator i = b->inos.find(path);
+	if(i != b->inos.end()) {
+		b->nodes[i->second].path = newpath;
+		b->inos[newpath] = i->second;
+		b->inos.erase(i);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	fuse_reply_err(req, 0);
+	inval_stale();
+}
+
+void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_open(path.c_str(), fi);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	// an open that was interrupted is not released by the kernel
+	if(fuse_reply_open(req, fi) == -ENOENT)
+		fs_release(path.c_str(), fi);
+}
+
+// The data is spliced from the temporary file with the main mutex held,
+// as fs_read reads it, so that it is not read half way through a reload
+void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	fs_state* b = FS_DATA;
+	struct fuse_bufvec* bufv;
+
+	int ret = fs_read_buf(node_path(ino).c_str(), &bufv, size, off, fi);
+	if(ret < 0) { reply_ret(req, ret); return; }
+
+	pthread_mutex_lock(&b->lock);
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	pthread_mutex_unlock(&b->lock);
+	free(bufv);
+}
+
+void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+	struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_write(path.c_str(), buf, size, off, fi);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	fuse_reply_write(req, ret);
+}
+
+void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+	struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_write_buf(path.c_str(), bufv, off, fi);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	fuse_reply_write(req, ret);
+}
+
+void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	reply_ret(req, fs_flush(node_path(ino).c_str(), fi));
+}
+
+void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	reply_ret(req, fs_release(node_path(ino).c_str(), fi));
+	inval_stale();
+}
+
+void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+	reply_ret(req, fs_fsync(node_path(ino).c_str(), datasync, fi));
+	inval_stale();
+}
+
+void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	int ret = fs_opendir(path.c_str(), fi);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	if(fuse_reply_open(req, fi) == -ENOENT)
+		fs_releasedir(path.c_str(), fi);
+}
+
+// The listing is read at offset 0 into the resource handler of the
+// directory handle, and the entries from offset `off' are added to the
+// reply until it is full. The offset of an entry is its index plus one.
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	fs_state* b = FS_DATA;
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+
+	if(!off) {
+		int ret = fs_readdir(path.c_str(), b, dir_skip, 0, fi);
+		if(ret < 0) { reply_ret(req, ret); return; }
+	}
+
+	// the entries of the root are databases, those of a database tables
+	std::vector<std::string> names;
+	std::vector<fuse_ino_t> inos;
+	names.push_back(".");
+	names.push_back("..");
+	pthread_mutex_lock(&b->lock);
+	std::map<int, std::vector<std::string> >::iterator v = b->v.find((int) fi->fh);
+	if(v != b->v.end())
+		names.insert(names.end(), v->second.begin(), v->second.end());
+	for(size_t i = 0; i < names.size(); i++) {
+		std::string p = i < 2 ? "" : (path == "/" ? "/" : path + "/") + names[i];
+		std::map<std::string, fuse_ino_t>::iterator n = b->inos.find(p);
+		inos.push_back(n != b->inos.end() ? n->second : UNKNOWN_INO);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	std::vector<char> buf(size + 1);
+	size_t n = 0;
+	for(size_t i = off; i < names.size(); i++) {
+		struct stat st;
+		memset(&st, 0, sizeof(st));
+		st.st_ino = inos[i];
+		st.st_mode = (i < 2 || path == "/") ? S_IFDIR : S_IFREG;
+		size_t len = fuse_add_direntry(req, &buf[n], size - n, names[i].c_str(), &st, i + 1);
+		if(len > size - n) break;
+		n += len;
+	}
+	fuse_reply_buf(req, &buf[0], n);
+}
+
+void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	reply_ret(req, fs_releasedir(node_path(ino).c_str(), fi));
+}
+
+void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) path = "/";
+
+	struct statvfs statv;
+	int ret = fs_statfs(path.c_str(), &statv);
+	if(ret < 0) { reply_ret(req, ret); return; }
+	fuse_reply_statfs(req, &statv);
+}
+
+void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+	size_t size, int flags)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+	reply_ret(req, fs_setxattr(path.c_str(), name, value, size, flags));
+	inval_stale();
+}
+
+void ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+	std::string path = node_path(ino);
+	if(path.empty()) { fuse_reply_err(req, ESTALE); return; }
+	reply_ret(req, fs_access(path.c_str(), mask));
+}
@@ -0,0 +1,409 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include <algorithm>
+#include <queue>
+#include <set>
+#include <stdexcept>
+#include "textfmt.hpp"
+#include "rowdiff.hpp"
+
+uint64_t row_hash(const char* s, size_t n)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for(size_t i = 0; i < n; i++) {
+		h ^= (unsigned char) s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+// Offset of the first row of file fname, after its header line
+static off_t first_row(const char* fname)
+{
+	std::string h = read_header(fname);
+	return h.size() ? h.size() + 1 : 0;
+}
+
+// An unlinked temporary file in the temporary directory, or NULL
+static FILE* tmp_file()
+{
+	std::string tmp = std::string(FS_DATA->rootdir) + "/.runs-XXXXXX";
+	int fd = mkstemp(&tmp[0]);
+	if(fd < 0) return NULL;
+	unlink(tmp.c_str());
+	FILE* f = fdopen(fd, "w+");
+	if(!f) close(fd);
+	return f;
+}
+
+// The hash of the primary key of row r, or of all its columns for a
+// table without primary key
+static uint64_t key_hash(const row_stmts& rs, const fmt_rows& rows, size_t r)
+{
+	std::string k = rs.key(rows, r);
+	return row_hash(k.data(), k.size());
+}
+
+// A row of a file in diff_set: the hash of its key and of the row, and
+// where it is in the file. Rows are ordered by the hash of their key
+// first, so identical rows, which have the same key, are still next to
+// each other, and the rows with a given key hash are together.
+struct row_entry {
+	uint64_t key;
+	uint64_t row;
+	off_t off;
+	size_t len;
+
+	bool operator<(const row_entry& o) const
+		{ return key != o.key ? key < o.key : row < o.row; }
+	bool same(const row_entry& o) const
+		{ return key == o.key && row == o.row; }
+};
+
+// The sorted row entries of a file. Up to DIFF_RUN_ROWS entries are
+// sorted in memory. The entries of larger files are written in sorted
+// runs to unlinked temporary files, which are merged as the entries are
+// read, so the memory used does not depend on the file size.
+struct hash_runs {
+	typedef std::pair<row_entry, size_t> head;
+	// orders the heads of the runs, lowest first
+	struct head_after {
+		bool operator()(const head& a, const head& b) const
+			{ return b.first < a.first; }
+	};
+
+	std::vector<row_entry> mem;
+	size_t pos;
+	std::vector<FILE*> runs;
+	std::priority_queue<head, std::vector<head>, head_after> heads;
+	size_t count;
+
+	hash_runs() : pos(0), count(0) {}
+	~hash_runs()
+	{
+		for(size_t i = 0; i < runs.size(); i++)
+			fclose(runs[i]);
+	}
+
+	// Sort the entries in memory and write them as a new run
+	bool spill()
+	{
+		std::sort(mem.begin(), mem.end());
+		FILE* f = tmp_file();
+		if(!f) return false;
+		runs.push_back(f);
+		if(fwrite(&mem[0], sizeof(row_entry), mem.size(), f) != mem.size())
+			return false;
+		mem.clear();
+		return true;
+	}
+
+	// Read the next entry of run i into the heads
+	void advance(size_t i)
+	{
+		row_entry h;
+		if(fread(&h, sizeof(h), 1, runs[i]) == 1)
+			heads.push(head(h, i));
+	}
+
+	// Hash the rows of file fname of table rs
+	bool build(const row_stmts& rs, const char* fname)
+	{
+		off_t pos = first_row(fname);
+		fmt_reader rd(fname, pos);
+		fmt_rows rows;
+		while(rd.next(rows)) {
+			for(size_t r = 0; r < rows.rows.size(); r++) {
+				if(mem.size() == DIFF_RUN_ROWS && !spill()) return false;
+				row_entry e;
+				e.key = key_hash(rs, rows, r);
+				e.row = row_hash(rd.buf.data() + rows.rows[r].line, rows.rows[r].len);
+				e.off = pos + rows.rows[r].line;
+				e.len = rows.rows[r].len;
+				mem.push_back(e);
+				count++;
+			}
+			// the parsed lines are dropped from the buffer by the next read
+			pos += rd.used;
+		}
+		if(!rd.good()) return false;
+
+		if(runs.empty()) {
+			std::sort(mem.begin(), mem.end());
+			return true;
+		}
+		if(mem.size() && !spill()) return false;
+		std::vector<row_entry>().swap(mem);
+		log_vmsg("+ hash_runs(%s): %lu rows in %lu runs\n", fname,
+			(unsigned long) count, (unsigned long) runs.size());
+		for(size_t i = 0; i < runs.size(); i++) {
+			if(fflush(runs[i]) || fseeko(runs[i], 0, SEEK_SET)) return false;
+			advance(i);
+		}
+		return true;
+	}
+
+	// Get the next entry in order. Returns false after the last one.
+	bool next(row_entry& h)
+	{
+		if(runs.empty()) {
+			if(pos == mem.size()) return false;
+			h = mem[pos++];
+			return true;
+		}
+		if(heads.empty()) return false;
+		h = heads.top().first;
+		size_t i = heads.top().second;
+		heads.pop();
+		advance(i);
+		return true;
+	}
+};
+
+// A differing row of diff_set, and whether it is added (from `from') or
+// removed (from `to')
+struct diff_entry {
+	row_entry e;
+	int add;
+};
+
+// Closes a temporary file at the end of its scope
+struct file_guard {
+	FILE* f;
+	explicit file_guard(FILE* x) : f(x) {}
+	~file_guard() { if(f) fclose(f); }
+};
+
+// Orders differing rows by their offset in the file
+static bool by_offset(const row_entry& a, const row_entry& b)
+{
+	return a.off < b.off;
+}
+
+// Read the rows v of file fname, in the order of the file, to out
+static bool read_rows(const char* fname, std::vector<row_entry>& v, std::string& out)
+{
+	if(v.empty()) return true;
+	int fd = open(fname, O_RDONLY);
+	if(fd < 0) return false;
+	std::sort(v.begin(), v.end(), by_offset);
+	bool ok = true;
+	for(size_t i = 0; ok && i < v.size(); i++) {
+		size_t n = out.size();
+		out.resize(n + v[i].len);
+		ok = pread(fd, &out[n], v[i].len, v[i].off) == (ssize_t) v[i].len;
+		out += '\n';
+	}
+	close(fd);
+	return ok;
+}
+
+// Read the differing rows [s, e) of the diff file df, as rows to add
+// from `from' and rows to remove from `to'. With removes, only the
+// removed rows whose key is not added again are kept; otherwise only
+// the others are, with the added rows.
+static bool read_batch(const row_stmts& rs, FILE* df, size_t s, size_t e,
+	const char* from, const char* to, bool removes, std::string& add, std::string& rm)
+{
+	std::vector<row_entry> va, vr;
+	diff_entry d;
+	if(fseeko(df, (off_t) s * sizeof(d), SEEK_SET)) return false;
+	for(size_t i = s; i < e; i++) {
+		if(fread(&d, sizeof(d), 1, df) != 1) return false;
+		(d.add ? va : vr).push_back(d.e);
+	}
+	std::string ra, rr;
+	if(!read_rows(from, va, ra) || !read_rows(to, vr, rr)) return false;
+
+	// a removed row whose key is added again is an update
+	fmt_rows ar, mr;
+	fmt_parse(ra.data(), ra.size(), ar);
+	fmt_parse(rr.data(), rr.size(), mr);
+	std::set<std::string> keys;
+	if(rs.cols.has_key())
+		for(size_t r = 0; r < ar.rows.size(); r++)
+			keys.insert(rs.key(ar, r));
+	for(size_t r = 0; r < mr.rows.size(); r++)
+		if(keys.count(rs.key(mr, r)) != (size_t) removes) {
+			rm.append(rr, mr.rows[r].line, mr.rows[r].len);
+			rm += '\n';
+		}
+	if(!removes) add.swap(ra);
+	return true;
+}
+
+bool diff_set(const row_stmts& rs, const char* from, const char* to, diff_sink& out)
+{
+	log_vmsg("+ diff_set(%s, %s)\n", from, to);
+
+	hash_runs a, b;
+	if(!a.build(rs, from) || !b.build(rs, to)) return false;
+
+	// The rows left over by the merge of the two sorted streams differ,
+	// and are written to a temporary file, in the order of their key
+	// hash. The batches are cut between key hashes, so rows with the
+	// same key are in the same batch.
+	file_guard df(tmp_file());
+	if(!df.f) return false;
+	std::vector<size_t> ends;
+	size_t n = 0, start = 0;
+	row_entry x, y, last = row_entry();
+	bool ha = a.next(x), hb = b.next(y);
+	while(ha || hb) {
+		diff_entry d;
+		if(!hb || (ha && x < y)) { d.e = x; d.add = 1; ha = a.next(x); }
+		else if(!ha || y < x) { d.e = y; d.add = 0; hb = b.next(y); }
+		else { ha = a.next(x); hb = b.next(y); continue; }
+		if(n - start >= DIFF_BATCH_ROWS && d.e.key != last.key)
+			ends.push_back(start = n);
+		if(fwrite(&d, sizeof(d), 1, df.f) != 1) return false;
+		last = d.e;
+		n++;
+	}
+	if(fflush(df.f)) return false;
+	if(n) ends.push_back(n);
+
+	log_vmsg("+ diff_set: %lu / %lu rows, %lu differ, %lu batches\n", (unsigned long) a.count,
+		(unsigned long) b.count, (unsigned long) n, (unsigned long) ends.size());
+
+	// Every batch removes its rows whose key is not added again before
+	// any batch inserts or updates a row, so an inserted row cannot
+	// conflict, on a unique index, with a row that a later batch removes
+	for(int removes = 1; removes >= 0; removes--)
+		for(size_t i = 0; i < ends.size(); i++) {
+			std::string add, rm;
+			if(!read_batch(rs, df.f, i ? ends[i - 1] : 0, ends[i], from, to,
+				removes, add, rm))
+				return false;
+			if(add.size() || rm.size()) out.apply(add, rm);
+		}
+	return true;
+}
+
+// A cursor over the rows of a table file, after its header line
+struct row_cursor {
+	fmt_reader rd;
+	fmt_rows rows;
+	size_t r;
+
+	explicit row_cursor(const char* fname) : rd(fname, first_row(fname)), r(0)
+		{ fetch(); }
+	bool end() const { return r >= rows.rows.size(); }
+	void next() { if(++r >= rows.rows.size()) fetch(); }
+	void fetch() { r = 0; rd.next(rows); }
+	const char* line() const { return rd.buf.data() + rows.rows[r].line; }
+	size_t len() const { return rows.rows[r].len; }
+};
+
+// Check that the current row of c has one field for each column
+static void check_fields(const row_stmts& rs, const row_cursor& c)
+{
+	if(c.rows.fields(c.r) != rs.cols.size())
+		throw std::runtime_error("row does not match the table header: " + rs.tab);
+}
+
+// True if the rows of file fname are sorted by strictly increasing key
+static bool key_sorted(const row_stmts& rs, const char* fname)
+{
+	row_cursor c(fname);
+	fmt_rows prev;
+	bool has = false;
+	for(; !c.end(); c.next()) {
+		check_fields(rs, c);
+		if(c.r) {
+			if(rs.compare_key(c.rows, c.r - 1, c.rows, c.r) >= 0) return false;
+		}
+		else if(has && rs.compare_key(prev, 0, c.rows, c.r) >= 0) return false;
+
+		// keep the last row of the batch for the next one
+		if(c.r + 1 == c.rows.rows.size()) {
+			std::string l(c.line(), c.len());
+			l += '\n';
+			prev.clear();
+			fmt_parse(l.data(), l.size(), prev);
+			has = true;
+		}
+	}
+	return c.rd.good();
+}
+
+// One pass of the merge of merge_key over the rows of files from and
+// to. The first pass only removes the rows whose key is not in `from',
+// and the second inserts or updates the others, so every row is removed
+// before any row is added, as a row that is added may take a unique
+// value of a row that is removed. Returns the number of rows applied.
+static size_t merge_pass(row_stmts& rs, const char* from, const char* to, bool removes)
+{
+	size_t changed = 0;
+	bool ups = rs.has_ups();
+	row_cursor a(from), b(to);
+	while(!a.end() || !b.end()) {
+		int c = a.end() ? 1 : b.end() ? -1 : rs.compare_key(a.rows, a.r, b.rows, b.r);
+		if(c < 0) {
+			if(!removes) {
+				if(ups) rs.upsert(a.rows, a.r);
+				else rs.insert(a.rows, a.r);
+				changed++;
+			}
+			a.next();
+		}
+		else if(c > 0) {
+			if(removes) {
+				if(ups) rs.remove_later(b.line(), b.len());
+				else rs.remove(b.rows, b.r);
+				changed++;
+			}
+			b.next();
+		}
+		else {
+			if(!removes && (a.len() != b.len() || memcmp(a.line(), b.line(), a.len()))) {
+				if(ups) rs.upsert(a.rows, a.r);
+				else if(rs.can_update()) rs.update(a.rows, a.r);
+				else { rs.remove(b.rows, b.r); rs.insert(a.rows, a.r); }
+				changed++;
+			}
+			a.next();
+			b.next();
+		}
+	}
+	if(removes) rs.flush();
+	if(!a.rd.good() || !b.rd.good())
+		throw std::runtime_error("merge_key: cannot read " + std::string(from));
+	return changed;
+}
+
+bool merge_key(row_stmts& rs, const char* from, const char* to, size_t& changed)
+{
+	log_vmsg("+ merge_key(%s, %s)\n", from, to);
+
+	changed = 0;
+	if(!rs.cols.has_key()) return false;
+	if(!key_sorted(rs, from) || !key_sorted(rs, to)) {
+		log_vmsg("+ merge_key: rows not in key order\n");
+		return false;
+	}
+
+	pend_guard pg(rs);
+	changed = merge_pass(rs, from, to, true);
+	changed += merge_pass(rs, from, to, false);
+	log_vmsg("+ merge_key: %lu rows changed\n", (unsigned long) changed);
+	return true;
+}
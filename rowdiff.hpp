@@ -0,0 +1,73 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef ROWDIFF_INCLUDED
+#define ROWDIFF_INCLUDED
+
+#include <string>
+#include <stdint.h>
+#include "rowstmt.hpp"
+
+// Row differences of table files, independent of the order of the
+// rows. The header line of each file is skipped. Rows are compared by
+// their raw line.
+
+// 64-bit FNV-1a hash of the n bytes at s
+uint64_t row_hash(const char* s, size_t n);
+
+// Maximum number of row hashes of a file sorted in memory by diff_set
+#define DIFF_RUN_ROWS (1 << 21)
+
+// Maximum number of differing rows of a batch of diff_set, on average
+#define DIFF_BATCH_ROWS (1 << 18)
+
+// Receiver of the batches of rows of diff_set
+struct diff_sink {
+	virtual ~diff_sink() {}
+	// Apply a batch of rows to add and rows to remove, one line each
+	virtual void apply(const std::string& add, const std::string& rm) = 0;
+};
+
+// Multiset difference of the rows of files `from' and `to', of table
+// rs: the rows of `from' that are not in `to' are added and the rows of
+// `to' that are not in `from' removed. A row that appears more times in
+// one file is added or removed as many times as the difference. The
+// hashes of the rows, with their place in the file, are sorted in
+// memory up to DIFF_RUN_ROWS rows per file, and externally in sorted
+// runs in the temporary directory for larger files; each file is read
+// once, and only the differing rows again. They are passed to out in
+// batches of about DIFF_BATCH_ROWS rows, by the hash of their primary
+// key, so rows with the same key are in the same batch: first the
+// removed rows whose key is not added again, for all the batches, then
+// the added rows with the removed rows they update. Returns false if a
+// file cannot be read or a run cannot be written.
+bool diff_set(const row_stmts& rs, const char* from, const char* to, diff_sink& out);
+
+// Streaming merge of the rows of files `from' and `to' by the primary
+// key of table rs, applying each row of `from' with a key that is not in
+// `to' as an insert, each row of `to' with a key that is not in `from'
+// as a delete and each changed row as an update. All the deletes are
+// applied before the inserts and updates. Reads each file three times
+// and keeps a single batch of rows in memory. Returns false, before any
+// change, if the table has no primary key or the files are not sorted
+// by strictly increasing key; otherwise sets `changed' to the number
+// of rows applied.
+bool merge_key(row_stmts& rs, const char* from, const char* to, size_t& changed);
+
+#endif
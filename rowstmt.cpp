@@ -0,0 +1,627 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include <stdexcept>
+#include <algorithm>
+#include "rowstmt.hpp"
+
+bool tab_cols::has_key() const
+{
+	for(size_t i = 0; i < key.size(); i++)
+		if(key[i]) return true;
+	return false;
+}
+
+bool tab_cols::has_autoinc() const
+{
+	for(size_t i = 0; i < autoinc.size(); i++)
+		if(autoinc[i]) return true;
+	return false;
+}
+
+bool tab_cols::parse(const std::string& header)
+{
+	names.clear();
+	types.clear();
+	key.clear();
+	autoinc.clear();
+	notnull.clear();
+
+	fmt_rows h;
+	std::string s = header + "\n";
+	fmt_parse(s.data(), s.size(), h);
+	if(h.rows.size() != 1) return false;
+
+	// each column is <column-name>(<data-type>)[<special-attributes>]
+	for(size_t i = 0; i < h.ends.size(); i++) {
+		std::string c = h.field(i);
+		std::string attr, type;
+		size_t e = c.rfind(')');
+		size_t b = (e == std::string::npos) ? e : c.rfind('(', e);
+		if(b != std::string::npos) {
+			attr = c.substr(e + 1);
+			type = c.substr(b + 1, e - b - 1);
+			c.erase(b);
+		}
+		if(c.empty()) return false;
+		names.push_back(c);
+		types.push_back(type);
+		key.push_back(attr.find('!') != std::string::npos);
+		autoinc.push_back(attr.find('+') != std::string::npos);
+		notnull.push_back(attr.find_first_of("*!") != std::string::npos);
+	}
+	return names.size() != 0;
+}
+
+std::string join_cols(const char* fn, const std::vector<std::string>& c,
+	const char* sep)
+{
+	std::string r;
+	for(size_t i = 0; i < c.size(); i++) {
+		std::vector<std::string> a(1, c[i]);
+		if(i) r += sep;
+		r += rt_call(fn, a).at(0);
+	}
+	return r;
+}
+
+// Generate a query with the retranse function fn on db, table and
+// the given arguments
+static std::string row_query(const char* fn, const row_stmts& rs,
+	const std::string& a1, const std::string& a2 = std::string())
+{
+	std::vector<std::string> a;
+	a.push_back(rs.db);
+	a.push_back(rs.tab);
+	a.push_back(a1);
+	if(a2.size()) a.push_back(a2);
+	std::string q = rt_call(fn, a).at(0);
+	log_vmsg("+ row_query %s: %s\n", fn, q.c_str());
+	return q;
+}
+
+// Parameter markers for n values, comma separated
+static std::string marks(size_t n)
+{
+	std::string ml;
+	for(size_t i = 0; i < n; i++)
+		ml += i ? ", ?" : "?";
+	return ml;
+}
+
+// The statements, each prepared on its first use
+static cppdb::statement& ins_stmt(row_stmts& rs)
+{
+	if(rs.ins.empty())
+		rs.ins = rs.sql->create_prepared_uncached_statement(
+			row_query("ins_row", rs, rs.col_list, marks(rs.cols.size())));
+	return rs.ins;
+}
+
+static cppdb::statement& del_stmt(row_stmts& rs)
+{
+	if(!rs.del.empty()) return rs.del;
+	if(rs.cols.has_key())
+		rs.del = rs.sql->create_prepared_uncached_statement(
+			row_query("rm_row", rs, join_cols("q_col_eq", rs.q_keys, " AND ")));
+	else
+		rs.del = rs.sql->create_prepared_uncached_statement(
+			row_query("rm_tab_1row", rs, join_cols("q_col_eq", rs.q_all, " AND ")));
+	return rs.del;
+}
+
+static cppdb::statement& upd_stmt(row_stmts& rs)
+{
+	if(!rs.upd.empty()) return rs.upd;
+	std::string set;
+	for(size_t i = 0; i < rs.q_vals.size(); i++) {
+		if(i) set += ", ";
+		set += rs.q_vals[i] + " = ?";
+	}
+	rs.upd = rs.sql->create_prepared_uncached_statement(
+		row_query("upd_row", rs, set, join_cols("q_col_eq", rs.q_keys, " AND ")));
+	return rs.upd;
+}
+
+// True if deln is prepared, or can be
+static bool has_deln(row_stmts& rs)
+{
+	if(rs.deln_state) return rs.deln_state > 0;
+	rs.deln_state = -1;
+	try {
+		rs.deln = rs.sql->create_prepared_uncached_statement(
+			row_query("rm_tab_nrows", rs, join_cols("q_col_eq", rs.q_all, " AND ")));
+		rs.deln_state = 1;
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ prepare rm_tab_nrows: %s\n", e.s.c_str()); }
+	return rs.deln_state > 0;
+}
+
+// Bind field i of a batch of parsed rows to a statement
+static void bind_field(cppdb::statement& st, const fmt_rows& rows, size_t i)
+{
+	if(rows.null(i)) st.bind_null();
+	else {
+		const char* d = rows.data.data() + rows.start(i);
+		st.bind(d, d + rows.size(i));
+	}
+}
+
+// Check that row r has one field for each column
+static void check_row(const row_stmts& rs, const fmt_rows& rows, size_t r)
+{
+	if(rows.fields(r) != rs.cols.size())
+		throw std::runtime_error("row does not match the table header: " + rs.tab);
+}
+
+void row_stmts::insert(const fmt_rows& rows, size_t r)
+{
+	check_row(*this, rows, r);
+	size_t f = rows.rows[r].first;
+	cppdb::statement& st = ins_stmt(*this);
+	st.reset();
+	for(size_t i = 0; i < cols.size(); i++)
+		bind_field(st, rows, f + i);
+	st.exec();
+}
+
+void row_stmts::remove(const fmt_rows& rows, size_t r)
+{
+	check_row(*this, rows, r);
+	size_t f = rows.rows[r].first;
+	bool k = cols.has_key();
+	cppdb::statement& st = del_stmt(*this);
+	st.reset();
+	for(size_t i = 0; i < cols.size(); i++)
+		if(!k || cols.key[i]) bind_field(st, rows, f + i);
+	st.exec();
+}
+
+void row_stmts::remove_n(const fmt_rows& rows, size_t r, unsigned long n)
+{
+	if(n == 1 || !has_deln(*this)) {
+		while(n--) remove(rows, r);
+		return;
+	}
+	check_row(*this, rows, r);
+	size_t f = rows.rows[r].first;
+	deln.reset();
+	for(size_t i = 0; i < cols.size(); i++)
+		bind_field(deln, rows, f + i);
+	deln.bind(n);
+	deln.exec();
+}
+
+// The condition that matches the rows of a table without primary key
+// that are identical to a row, with its values as parameters
+static std::string row_cond(const row_stmts& rs)
+{
+	return "( " + join_cols("q_col_eq", rs.q_all, " AND ") + " )";
+}
+
+// The conditions of n rows, joined with sep
+static std::string row_conds(const row_stmts& rs, size_t n, const char* sep)
+{
+	std::string c = row_cond(rs), w;
+	for(size_t i = 0; i < n; i++) {
+		if(i) w += sep;
+		w += c;
+	}
+	return w;
+}
+
+// Prepare the count of n rows with cnt_rows
+static cppdb::statement cnt_stmt(row_stmts& rs, size_t n)
+{
+	std::vector<std::string> a;
+	a.push_back(rs.db);
+	a.push_back(rs.tab);
+	a.push_back(join_cols("cnt_cond", std::vector<std::string>(n, row_cond(rs)), ", "));
+	a.push_back(row_conds(rs, n, " OR "));
+	std::string q = rt_call("cnt_rows", a).at(0);
+	log_vmsg("+ row_query cnt_rows: %s\n", q.c_str());
+	return rs.sql->create_prepared_uncached_statement(q);
+}
+
+// Bind all the fields of row r to a statement
+static void bind_row(const row_stmts& rs, cppdb::statement& st, const fmt_rows& rows,
+	size_t r)
+{
+	size_t f = rows.rows[r].first;
+	for(size_t i = 0; i < rs.cols.size(); i++)
+		bind_field(st, rows, f + i);
+}
+
+void row_stmts::remove_rows(const fmt_rows& rows,
+	const std::vector<std::pair<size_t, unsigned long> >& g)
+{
+	if(!cntb_state) {
+		cntb_state = -1;
+		try {
+			cntb = cnt_stmt(*this, RM_BATCH_ROWS);
+			cntb_state = 1;
+		}
+		catch(retranse::rtex& e)
+			{ log_vmsg("+ prepare cnt_rows: %s\n", e.s.c_str()); }
+	}
+
+	for(size_t b = 0; b < g.size(); b += RM_BATCH_ROWS) {
+		size_t n = std::min(g.size() - b, (size_t) RM_BATCH_ROWS);
+		if(n == 1 || cntb_state < 0) {
+			for(size_t i = b; i < b + n; i++)
+				remove_n(rows, g[i].first, g[i].second);
+			continue;
+		}
+		for(size_t i = b; i < b + n; i++)
+			check_row(*this, rows, g[i].first);
+
+		// count the copies of each row in the table
+		cppdb::statement st = n == RM_BATCH_ROWS ? cntb : cnt_stmt(*this, n);
+		st.reset();
+		for(int k = 0; k < 2; k++)
+			for(size_t i = b; i < b + n; i++)
+				bind_row(*this, st, rows, g[i].first);
+		cppdb::result res = st.query();
+		std::vector<unsigned long> have(n, 0);
+		if(res.next())
+			for(size_t i = 0; i < n; i++) {
+				std::string v;
+				if(res.fetch(i, v)) have[i] = strtoul(v.c_str(), NULL, 10);
+			}
+		res = cppdb::result();
+
+		// the rows of which no copy is left are removed together
+		std::vector<size_t> all;
+		for(size_t i = 0; i < n; i++) {
+			if(!have[i]) continue;
+			if(have[i] <= g[b + i].second) all.push_back(g[b + i].first);
+			else remove_n(rows, g[b + i].first, g[b + i].second);
+		}
+		if(all.empty()) continue;
+		std::vector<std::string> a;
+		a.push_back(db);
+		a.push_back(tab);
+		a.push_back(row_conds(*this, all.size(), " OR "));
+		std::string q = rt_call("rm_tab_rows", a).at(0);
+		log_vmsg("+ row_query rm_tab_rows: %s\n", q.c_str());
+		cppdb::statement dm = sql->create_prepared_uncached_statement(q);
+		for(size_t i = 0; i < all.size(); i++)
+			bind_row(*this, dm, rows, all[i]);
+		dm.exec();
+	}
+}
+
+void row_stmts::upsert(const fmt_rows& rows, size_t r)
+{
+	if(!has_ups()) throw std::runtime_error("upsert: not available for " + tab);
+	check_row(*this, rows, r);
+	size_t f = rows.rows[r].first;
+	ups.reset();
+	for(size_t i = 0; i < cols.size(); i++)
+		bind_field(ups, rows, f + i);
+	ups.exec();
+}
+
+void row_stmts::remove_later(const char* line, size_t len)
+{
+	pend.append(line, len);
+	pend += '\n';
+	if(++npend == RM_BATCH_ROWS) flush();
+}
+
+void row_stmts::flush()
+{
+	if(!npend) return;
+	fmt_rows rows;
+	fmt_parse(pend.data(), pend.size(), rows);
+	pend.clear();
+	npend = 0;
+
+	if(rows.rows.size() != RM_BATCH_ROWS || !has_ups()) {
+		for(size_t r = 0; r < rows.rows.size(); r++)
+			remove(rows, r);
+		return;
+	}
+	delb.reset();
+	for(size_t r = 0; r < rows.rows.size(); r++) {
+		check_row(*this, rows, r);
+		for(size_t i = 0; i < cols.size(); i++)
+			if(cols.key[i]) bind_field(delb, rows, rows.rows[r].first + i);
+	}
+	delb.exec();
+}
+
+unsigned long long row_stmts::update(const fmt_rows& rows, size_t r)
+{
+	check_row(*this, rows, r);
+	size_t f = rows.rows[r].first;
+	cppdb::statement& st = upd_stmt(*this);
+	st.reset();
+	for(size_t i = 0; i < cols.size(); i++)
+		if(!cols.key[i]) bind_field(st, rows, f + i);
+	for(size_t i = 0; i < cols.size(); i++)
+		if(cols.key[i]) bind_field(st, rows, f + i);
+	st.exec();
+	return st.affected();
+}
+
+// True if the table has a row with the primary key of row r
+static bool has_row(row_stmts& rs, const fmt_rows& rows, size_t r)
+{
+	if(rs.cntk.empty()) {
+		std::string c = "( " + join_cols("q_col_eq", rs.q_keys, " AND ") + " )";
+		std::vector<std::string> a;
+		a.push_back(rs.db);
+		a.push_back(rs.tab);
+		a.push_back(join_cols("cnt_cond", std::vector<std::string>(1, c), ", "));
+		a.push_back(c);
+		std::string q = rt_call("cnt_rows", a).at(0);
+		log_vmsg("+ row_query cnt_rows: %s\n", q.c_str());
+		rs.cntk = rs.sql->create_prepared_uncached_statement(q);
+	}
+	size_t f = rows.rows[r].first;
+	rs.cntk.reset();
+	for(int k = 0; k < 2; k++)
+		for(size_t i = 0; i < rs.cols.size(); i++)
+			if(rs.cols.key[i]) bind_field(rs.cntk, rows, f + i);
+	cppdb::result res = rs.cntk.query();
+	std::string v;
+	return res.next() && res.fetch(0, v) && strtoul(v.c_str(), NULL, 10) > 0;
+}
+
+void row_stmts::merge(const fmt_rows& rows, size_t r)
+{
+	check_row(*this, rows, r);
+	if(can_update() && update(rows, r)) return;
+	if(!has_row(*this, rows, r)) insert(rows, r);
+}
+
+std::string row_stmts::key(const fmt_rows& rows, size_t r) const
+{
+	std::string k;
+	size_t f = rows.rows[r].first;
+	bool hk = cols.has_key();
+	for(size_t i = 0; i < cols.size() && f + i < rows.ends.size(); i++) {
+		if(hk && !cols.key[i]) continue;
+		if(rows.null(f + i)) { k += "N;"; continue; }
+		char n[32];
+		sprintf(n, "%lu:", (unsigned long) rows.size(f + i));
+		k += n;
+		k.append(rows.data, rows.start(f + i), rows.size(f + i));
+	}
+	return k;
+}
+
+// True if the n bytes at s are an integer: an optional sign and digits
+static bool is_int(const char* s, size_t n)
+{
+	size_t i = (n && (*s == '-' || *s == '+')) ? 1 : 0;
+	if(i == n) return false;
+	for(; i < n; i++)
+		if(s[i] < '0' || s[i] > '9') return false;
+	return true;
+}
+
+// Compare two integers given as text
+static int cmp_int(const char* a, size_t an, const char* b, size_t bn)
+{
+	bool na = *a == '-', nb = *b == '-';
+	if(na != nb) return na ? -1 : 1;
+	if(*a == '-' || *a == '+') { a++; an--; }
+	if(*b == '-' || *b == '+') { b++; bn--; }
+	while(an > 1 && *a == '0') { a++; an--; }
+	while(bn > 1 && *b == '0') { b++; bn--; }
+	int c = an < bn ? -1 : an > bn ? 1 : memcmp(a, b, an);
+	return na ? -c : c;
+}
+
+// Compare two byte strings
+static int cmp_bytes(const char* a, size_t an, const char* b, size_t bn)
+{
+	int c = memcmp(a, b, an < bn ? an : bn);
+	if(c) return c;
+	return an < bn ? -1 : an > bn ? 1 : 0;
+}
+
+// True if the n bytes at s are a floating point number, which is set to d
+static bool is_real(const char* s, size_t n, double& d)
+{
+	if(!n) return false;
+	std::string t(s, n);
+	char* e;
+	d = strtod(t.c_str(), &e);
+	return !*e;
+}
+
+// Compare two values given as text of a column of the given data type:
+// integers and floating point numbers by value, any other type byte by
+// byte. Values of a numeric column that are not numbers are ordered
+// after the numbers, byte by byte, so that the order is the same for
+// any set of values.
+static int cmp_value(const std::string& type, const char* a, size_t an,
+	const char* b, size_t bn)
+{
+	char t = type.size() ? type[0] : 0;
+	if(t == 'i' || t == 'I') {
+		bool ia = is_int(a, an), ib = is_int(b, bn);
+		if(ia && ib) return cmp_int(a, an, b, bn);
+		if(ia != ib) return ia ? -1 : 1;
+	}
+	else if(t == 'f' || t == 'F') {
+		double da, db;
+		bool ra = is_real(a, an, da), rb = is_real(b, bn, db);
+		if(ra && rb) return da < db ? -1 : da > db ? 1 : 0;
+		if(ra != rb) return ra ? -1 : 1;
+	}
+	return cmp_bytes(a, an, b, bn);
+}
+
+int row_stmts::compare_key(const fmt_rows& a, size_t ra, const fmt_rows& b, size_t rb) const
+{
+	size_t fa = a.rows[ra].first, fb = b.rows[rb].first;
+	bool hk = cols.has_key();
+	for(size_t i = 0; i < cols.size(); i++) {
+		if(hk && !cols.key[i]) continue;
+		bool an = a.null(fa + i), bn = b.null(fb + i);
+		if(an || bn) {
+			if(an != bn) return an ? -1 : 1;
+			continue;
+		}
+		int c = cmp_value(cols.types[i], a.data.data() + a.start(fa + i), a.size(fa + i),
+			b.data.data() + b.start(fb + i), b.size(fb + i));
+		if(c) return c;
+	}
+	return 0;
+}
+
+bool row_stmts::can_update() const
+{
+	if(!cols.has_key()) return false;
+	for(size_t i = 0; i < cols.size(); i++)
+		if(!cols.key[i]) return true;
+	return false;
+}
+
+// Prepare the statements of the upsert mode of a table with primary key:
+// ups_row with the columns, their parameters, the key columns and the
+// assignment of each non-key column (or of the keys if all the columns
+// are keys) with ups_set, and rm_rows with the key columns and a list
+// of RM_BATCH_ROWS parameter tuples.
+static void prepare_upsert(row_stmts& rs)
+{
+	std::vector<std::string> a;
+	a.push_back(rs.db);
+	a.push_back(rs.tab);
+	a.push_back(rs.col_list);
+	a.push_back(marks(rs.cols.size()));
+	a.push_back(rs.key_list);
+	a.push_back(join_cols("ups_set", rs.q_vals.size() ? rs.q_vals : rs.q_keys, ", "));
+	std::string q = rt_call("ups_row", a).at(0);
+	log_vmsg("+ row_query ups_row: %s\n", q.c_str());
+	rs.ups = rs.sql->create_prepared_uncached_statement(q);
+
+	std::string t = "( " + marks(rs.q_keys.size()) + " )";
+	std::string tl;
+	for(size_t i = 0; i < RM_BATCH_ROWS; i++) {
+		if(i) tl += ", ";
+		tl += t;
+	}
+	rs.delb = rs.sql->create_prepared_uncached_statement(
+		row_query("rm_rows", rs, rs.key_list, tl));
+}
+
+bool row_stmts::has_ups()
+{
+	if(ups_state) return ups_state > 0;
+	ups_state = -1;
+	if(!upsert_mode || !cols.has_key()) return false;
+	try {
+		prepare_upsert(*this);
+		ups_state = 1;
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ prepare ups_row: %s\n", e.s.c_str()); }
+	return ups_state > 0;
+}
+
+// Quote the column names of a table and build its column lists
+static void quote_cols(row_stmts& rs)
+{
+	for(size_t i = 0; i < rs.cols.size(); i++) {
+		std::vector<std::string> a(1, rs.cols.names[i]);
+		std::string q = rt_call("q_col", a).at(0);
+		rs.q_all.push_back(q);
+		if(rs.cols.key[i]) rs.q_keys.push_back(q);
+		else rs.q_vals.push_back(q);
+	}
+	for(size_t i = 0; i < rs.q_all.size(); i++) {
+		if(i) rs.col_list += ", ";
+		rs.col_list += rs.q_all[i];
+	}
+	for(size_t i = 0; i < rs.q_keys.size(); i++) {
+		if(i) rs.key_list += ", ";
+		rs.key_list += rs.q_keys[i];
+	}
+}
+
+row_stmts& stmt_cache::get(const char* p1, const char* p2, const std::string& header)
+{
+	std::string k = std::string(p1) + "/" + p2;
+	std::map<std::string, row_stmts*>::iterator it = tabs.find(k);
+	if(it != tabs.end()) {
+		if(it->second->header == header) return *it->second;
+		// the schema has changed
+		delete it->second;
+		tabs.erase(it);
+	}
+
+	row_stmts* rs = new row_stmts(sql);
+	rs->db = p1;
+	rs->tab = p2;
+	rs->header = header;
+	rs->upsert_mode = upsert;
+	try {
+		if(!rs->cols.parse(header))
+			throw std::runtime_error("invalid table header: " + header);
+		quote_cols(*rs);
+	}
+	catch(...) {
+		delete rs;
+		throw;
+	}
+	tabs[k] = rs;
+	return *rs;
+}
+
+void stmt_cache::drop(const char* p1, const char* p2)
+{
+	std::string k = std::string(p1) + "/" + p2;
+	std::map<std::string, row_stmts*>::iterator it = tabs.find(k);
+	if(it == tabs.end()) return;
+	delete it->second;
+	tabs.erase(it);
+}
+
+void stmt_cache::drop_db(const char* p1)
+{
+	std::string k = std::string(p1) + "/";
+	std::map<std::string, row_stmts*>::iterator it = tabs.lower_bound(k);
+	while(it != tabs.end() && !it->first.compare(0, k.size(), k)) {
+		delete it->second;
+		tabs.erase(it++);
+	}
+}
+
+void stmt_cache::clear()
+{
+	std::map<std::string, row_stmts*>::iterator it;
+	for(it = tabs.begin(); it != tabs.end(); ++it)
+		delete it->second;
+	tabs.clear();
+}
+
+std::string read_header(const char* fname)
+{
+	std::ifstream is(fname);
+	std::string line;
+	std::getline(is, line);
+	return line;
+}
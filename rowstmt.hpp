@@ -0,0 +1,190 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef ROWSTMT_INCLUDED
+#define ROWSTMT_INCLUDED
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cppdb/frontend.h>
+#include "textfmt.hpp"
+
+// Prepared statements for inserting, deleting and updating single rows
+// of a table. The SQL text is generated once per table and session by
+// the retranse configuration (functions q_col, q_col_eq, ins_row,
+// rm_row, upd_row, rm_tab_1row and rm_tab_nrows) and the row values are bound as
+// parameters, so neither the SQL generation nor the parsing of the
+// statement by the server is repeated for every row. Each statement is
+// prepared when it is first used, so a table that is only read, or a
+// view, needs none, and an engine without some of the functions fails
+// only on the changes that need them.
+
+// Number of primary keys deleted by a batched delete of the upsert mode
+#define RM_BATCH_ROWS 100
+
+// The columns of a table as described by the header line of its file
+struct tab_cols {
+	std::vector<std::string> names;
+	// the data type of each column, such as i or v64 (see doc/FORMAT)
+	std::vector<std::string> types;
+	// primary key flag of each column
+	std::vector<char> key;
+	// autoincrement flag of each column
+	std::vector<char> autoinc;
+	// not null flag of each column, which primary key columns have too
+	std::vector<char> notnull;
+
+	size_t size() const { return names.size(); }
+	bool has_key() const;
+	bool has_autoinc() const;
+	// Parse a header line. Returns false if it is not a valid header.
+	bool parse(const std::string& header);
+};
+
+// The row statements of a single table
+struct row_stmts {
+	std::string db;
+	std::string tab;
+	std::string header;
+	tab_cols cols;
+	// the quoted column names, comma separated
+	std::string col_list;
+	// the quoted primary key column names, comma separated
+	std::string key_list;
+
+	cppdb::session* sql;
+	// the quoted names of all, key and non-key columns
+	std::vector<std::string> q_all, q_keys, q_vals;
+	cppdb::statement ins;
+	cppdb::statement del;
+	cppdb::statement upd;
+	// For tables without primary key, the deletion of a given number
+	// of identical rows, if the engine has rm_tab_nrows
+	cppdb::statement deln;
+	// For tables without primary key, the count of each of RM_BATCH_ROWS
+	// rows with a single scan, if the engine has cnt_rows
+	cppdb::statement cntb;
+	// For tables with a primary key, the count of the rows with the key
+	// of a row, with cnt_rows
+	cppdb::statement cntk;
+	// For tables with a primary key in upsert mode, the insertion or
+	// update of a row and the deletion of RM_BATCH_ROWS keys, if the
+	// engine has ups_row and rm_rows
+	cppdb::statement ups;
+	cppdb::statement delb;
+	// the upsert mode is on
+	bool upsert_mode;
+	// state of deln, cntb and ups: 0 not prepared yet, 1 prepared and
+	// -1 not available
+	int deln_state;
+	int cntb_state;
+	int ups_state;
+	// the rows whose keys are to be deleted in a batch, as text
+	std::string pend;
+	size_t npend;
+
+	row_stmts(cppdb::session* s) : sql(s), upsert_mode(false), deln_state(0),
+		cntb_state(0), ups_state(0), npend(0) {}
+
+	// Run the statement on row r of a batch of parsed rows
+	void insert(const fmt_rows& rows, size_t r);
+	void remove(const fmt_rows& rows, size_t r);
+	// update returns the number of rows changed, which some servers
+	// do not count when the values are the same
+	unsigned long long update(const fmt_rows& rows, size_t r);
+	// Remove n rows that are identical to row r
+	void remove_n(const fmt_rows& rows, size_t r, unsigned long n);
+	// Remove, from a table without primary key, the given number of
+	// copies of each of the given rows, which are distinct. Up to
+	// RM_BATCH_ROWS rows are counted with a single scan of the table,
+	// and the rows of which no copy is to be left are then removed with
+	// another scan; the other rows are removed with remove_n.
+	void remove_rows(const fmt_rows& rows,
+		const std::vector<std::pair<size_t, unsigned long> >& g);
+	// Insert row r, or update the row with its primary key
+	void upsert(const fmt_rows& rows, size_t r);
+	// The same with the update and insert statements, for a table with
+	// a primary key: the row is updated, and inserted if no row has its
+	// key. Unlike a removal and insertion, this fires no delete triggers
+	// or cascades on the rows that refer to it.
+	void merge(const fmt_rows& rows, size_t r);
+	// Remove the row with the key of the given row line, in a batch
+	// with other rows. flush removes the rows of an incomplete batch.
+	void remove_later(const char* line, size_t len);
+	void flush();
+
+	// A string that identifies the primary key value of row r.
+	// For tables without primary key all columns are used.
+	std::string key(const fmt_rows& rows, size_t r) const;
+	// Compare the primary key values of row ra of a and row rb of b:
+	// negative, zero or positive. The values of integer and floating
+	// point columns are compared by value, those of other columns byte
+	// by byte, and NULL is lowest. The server may order text by a
+	// collation instead, in which case its rows do not appear sorted.
+	int compare_key(const fmt_rows& a, size_t ra, const fmt_rows& b, size_t rb) const;
+	// True if the rows can be updated in place by primary key
+	bool can_update() const;
+	// True if the rows are applied with upsert and remove_later: the
+	// upsert mode is on, the table has a primary key and the engine has
+	// ups_row and rm_rows
+	bool has_ups();
+};
+
+// Discards the rows of a row_stmts that are batched for removal and not
+// flushed, when it goes out of scope, so that the rows of a failed
+// commit are not removed by the next one
+struct pend_guard {
+	row_stmts& rs;
+	explicit pend_guard(row_stmts& r) : rs(r) {}
+	~pend_guard() { rs.pend.clear(); rs.npend = 0; }
+};
+
+// The cache of row statements of a session, by table
+struct stmt_cache {
+	cppdb::session* sql;
+	std::map<std::string, row_stmts*> tabs;
+	// use the statements of the upsert mode
+	bool upsert;
+
+	stmt_cache(cppdb::session* s) : sql(s), upsert(false) {}
+	~stmt_cache() { clear(); }
+
+	// Get the statements of table p2 in database p1 whose file has
+	// the given header line. If the header has changed since the
+	// statements were generated, they are generated again.
+	// Throws std::runtime_error if the header is not valid.
+	row_stmts& get(const char* p1, const char* p2, const std::string& header);
+
+	// Forget the statements of a table or of all the tables of a
+	// database, when they are dropped or renamed
+	void drop(const char* p1, const char* p2);
+	void drop_db(const char* p1);
+	void clear();
+};
+
+// Join the results of the retranse function fn on each of the given
+// column names, with separator sep
+std::string join_cols(const char* fn, const std::vector<std::string>& c,
+	const char* sep);
+
+// The first line of a file, which is the table header
+std::string read_header(const char* fname);
+
+#endif
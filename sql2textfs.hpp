@@ -33,9 +33,9 @@
 #define SQL2TEXTFS_HPP_INCLUDED
 
 // The FUSE API has been changed a number of times.  So, our code
-// needs to define the version of the API that we assume.  As of this
-// writing, the most current API version is 26
-#define FUSE_USE_VERSION 26
+// needs to define the version of the API that we assume.  sql2textfs
+// uses the low-level API of FUSE 3, of which the version is 31
+#define FUSE_USE_VERSION 31
 
 // need this to get pwrite(). We have to use setvbuf() instead of
 // setlinebuf() later in consequence.
@@ -49,7 +49,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <libgen.h>
 #include <limits.h>
 #include <stdlib.h>
@@ -58,8 +58,11 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/xattr.h>
+#include <stdint.h>
 
+#include <map>
 #include <string>
 #include <vector>
 #include <fstream>
@@ -67,17 +70,121 @@
 
 #include "log.hpp"
 #include "rdel.hpp"
+#include "sqlops.hpp"
+#include "rowstmt.hpp"
+#include "clone.hpp"
+
+// The extension of the clone of a table's temporary file, that holds
+// the table as it was read from the database
+#define DBCLONEEXT ".o"
+
+// The row diff modes of commits: `diff' of the lines of a table file,
+// multiset difference of its rows, or merge of its rows in primary key
+// order, the order in which tables are then read
+#define DIFF_LINE 0
+#define DIFF_SET 1
+#define DIFF_KEY 2
+
+// The extended attribute that, set on a table file or a directory,
+// commits its table files now
+#define FLUSH_XATTR "user.sql2textfs.flush"
 
 // This is a macro that returns the fuse private data.
 // This data will be needed in all fuse callback functions.
-#define FS_DATA ((fs_state *) fuse_get_context()->private_data)
+// It is kept in a global, rather than taken from the fuse context,
+// so that it is also available to the threads of sql2textfs.
+struct fs_state;
+extern fs_state* fs_private;
+#define FS_DATA (fs_private)
+
+// The database connection of the current thread: the connection of the
+// write-back worker in its thread, or else the main connection, which
+// is part of the fuse private data.
+struct db_conn;
+extern __thread db_conn* fs_thread_db;
+#define FS_DB (fs_thread_db ? fs_thread_db : static_cast<db_conn*>(FS_DATA))
+
+// The write state of a table file since its baseline clone was taken
+struct fs_file {
+	// size of the baseline clone
+	off_t base;
+	// lowest offset written to or truncated at, -1 if none
+	off_t low;
+	// lowest size truncated to, -1 if none
+	off_t trunc;
+	// disjoint byte ranges [first, second) written or truncated
+	std::map<off_t, off_t> dirty;
+	// version of the table when the baseline was read, empty if unknown
+	std::string version;
+	// generation of the contents, counted up each time the file is
+	// written to or read from the database with changes, and the
+	// generation of the pages that the kernel has cached
+	unsigned long gen;
+	unsigned long cached;
+	// checksum of the contents as last read from the database, and the
+	// generation they were read as
+	uint64_t sum;
+	unsigned long sumgen;
+	fs_file() : base(0), low(-1), trunc(-1), gen(0), cached(0), sum(0), sumgen(0) {}
+};
+
+// The directory of the temporary directory that holds the private copies
+// of table files, and the new baseline clones while they are written
+#define PRIVDIR "/.private"
+
+// A private copy of a table file, for a handle opened for writing while
+// the table file is open. It starts from the baseline clone of the table
+// file, which is copied as its own baseline, tmp + DBCLONEEXT, so that
+// the commits of either one do not change the baseline of the other.
+struct fs_copy {
+	// fs-relative path of the table file
+	std::string path;
+	// path of the private copy
+	std::string tmp;
+	// write state of the private copy
+	fs_file f;
+	// the handle appends to the copy
+	bool append;
+};
+
+// A node of the file system that the kernel has looked up: the root, a
+// database directory or a table file
+struct fs_node {
+	// fs-relative path
+	std::string path;
+	// lookups of the node that the kernel has not forgotten yet
+	uint64_t nlookup;
+	fs_node() : nlookup(0) {}
+};
+
+// A connection to the database. Each connection is used by one thread
+// at a time.
+struct db_conn {
+	// Handle to an sql2text database connection
+	sql2text::handle* h;
+
+	// The database session and compiled retranse configuration that
+	// the handle h was created with. Used for queries that are not
+	// part of the sql2text interface.
+	cppdb::session* sql;
+	retranse::node* nc;
+
+	// Cache of prepared row statements on the session sql
+	stmt_cache* stmts;
+
+	// Transaction flag (1: a commit holds a transaction on the session,
+	// and the commit steps do not start their own)
+	int tx;
+};
 
 // The struct fs_state contains all the fuse private data.
 // This data contains every permanant variable that is
 // needed for a single mounted directory.
 // This struct can be accessed from every fuse callback
 // function using the FS_DATA macro.
-struct fs_state {
+// The main database connection is its base; the connection of the
+// current thread is accessed using the FS_DB macro.
+struct fs_state : db_conn {
 
 	// The log-file that logs every action of sql2textfs
 	FILE *logfile;
@@ -89,8 +196,26 @@ struct fs_state {
 	// The mount directory path
 	char *rootdir;
 
-	// Handle to an sql2text database connection
-	sql2text::handle* h;
+	// The connection info of the database connections
+	cppdb::connection_info* ci;
+
+	// Row diff mode of commits (DIFF_LINE, DIFF_SET or DIFF_KEY)
+	int diffmode;
+	// Staging flag (0: apply whole file commits row by row, 1: apply
+	// them on the server through a staging table, for tables with a
+	// primary key)
+	int stage;
+	// Merge flag (0: commit against the baseline, 1: check the version
+	// of the table in the commit transaction and merge with the changes
+	// of other clients if it has changed)
+	int merge;
+
+	// Snapshot window in milliseconds (0: no snapshot mode)
+	int snapshot;
+	// Snapshot flag (0: no snapshot, 1: a snapshot transaction is held)
+	int snap_active;
+	// The time the current snapshot transaction was started
+	struct timeval snap_time;
 
 	// Mutual Exclusion handle for pthread library.
 	// Ensures that all calls to sql2textfs handlers are
@@ -124,6 +249,61 @@ struct fs_state {
 	// A flag that is true if a file is open.
 	// number n > 0 means file has been opened n times
 	std::map<std::string, int> openfiles;
+
+	// The write state of each table file, by path
+	std::map<std::string, fs_file> files;
+
+	// The inode table: the nodes that the kernel has looked up, by inode
+	// number, and the inode number of each of their paths
+	std::map<fuse_ino_t, fs_node> nodes;
+	std::map<std::string, fuse_ino_t> inos;
+	fuse_ino_t next_ino;
+	// The fuse session, and the inodes of open table files that were read
+	// again, whose cached pages the kernel is told to drop once the
+	// callback that read them has replied
+	struct fuse_session* se;
+	std::vector<fuse_ino_t> stale;
+	// Timeout in seconds of the entries and attributes that the kernel
+	// caches
+	double timeout;
+
+	// Private copy flag (0: all the handles of a table file share it,
+	// 1: a handle opened for writing while the file is open gets a
+	// private copy, which is merged when it is committed)
+	int priv;
+	// The private copies, by file handle
+	std::map<uint64_t, fs_copy> copies;
+
+	// The directory of the write-ahead journal, NULL if none
+	char* journal;
+
+	// The pool of connections that large change sets are applied on in
+	// parallel, empty if none, and its lock: a commit that finds it
+	// taken applies its rows on its own connection
+	std::vector<db_conn*> pool;
+	pthread_mutex_t plock;
+	// Seconds that a statement of the pool waits for a row lock, which
+	// another part of the same change set may hold until all are applied
+	int lockwait;
+
+	// Write-back flag (0: commit on release, 1: queue the commit to
+	// the write-back worker)
+	int async;
+	// The connection and thread of the write-back worker
+	db_conn* wdb;
+	pthread_t worker;
+	// Signaled when a commit is queued and when one is done
+	pthread_cond_t cjob;
+	pthread_cond_t cdone;
+	// Coalescing window in milliseconds: the commit of a table file
+	// is delayed until it has not been released for this long
+	int coalesce;
+	// The table files queued for commit, with the time each is due,
+	// and the table file whose commit is running, if any
+	std::map<std::string, struct timeval> queued;
+	std::string running;
+	// Stop flag of the worker
+	int stop;
 };
 
 // --------------------------------------------------------
@@ -140,6 +320,18 @@ static __attribute__ ((unused)) void fs_fullpath(char fpath[PATH_MAX], const cha
 		FS_DATA->rootdir, path, fpath);
 }
 
+// Read a whole table from the database to its temporary file, and clone
+// the temporary file as the baseline of the table. If the write state f
+// of the file is given, its version is read along, and its generation
+// counted up if the contents have changed. Defined in fuse.cpp.
+bool readtab(const char * p1, const char * p2, fs_file* f = NULL);
+bool copytab(const char * p1, const char * p2);
+
+// Commit a table file to the database and read it again if needed.
+// Called from the fuse callbacks with the main mutex locked, or from the
+// write-back worker with it unlocked. Defined in fuse.cpp.
+int fs_commit(const char* path, fs_file* f);
+
 // Report errors to logfile and give -errno to caller
 static __attribute__ ((unused)) int fs_error(const char *str)
 {
@@ -150,6 +342,9 @@ static __attribute__ ((unused)) int fs_error(const char *str)
 	return ret;
 }
 
+// The function that fs_readdir adds each directory entry with
+typedef int (*fs_fill_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
+
 // --------------------------------------------------------
 // callback declarations
 
@@ -168,8 +363,12 @@ int fs_truncate(const char *path, off_t newsize);
 int fs_utime(const char *path, struct utimbuf *ubuf);
 int fs_open(const char *path, struct fuse_file_info *fi);
 int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int fs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	struct fuse_file_info *fi);
 int fs_write(const char *path, const char *buf, size_t size, off_t offset,
 	     struct fuse_file_info *fi);
+int fs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi);
 int fs_statfs(const char *path, struct statvfs *statv);
 int fs_flush(const char *path, struct fuse_file_info *fi);
 int fs_release(const char *path, struct fuse_file_info *fi);
@@ -179,7 +378,7 @@ int fs_getxattr(const char *path, const char *name, char *value, size_t size);
 int fs_listxattr(const char *path, char *list, size_t size);
 int fs_removexattr(const char *path, const char *name);
 int fs_opendir(const char *path, struct fuse_file_info *fi);
-int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+int fs_readdir(const char *path, void *buf, fs_fill_t filler, off_t offset,
 	       struct fuse_file_info *fi);
 int fs_releasedir(const char *path, struct fuse_file_info *fi);
 int fs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
@@ -190,53 +389,77 @@ int fs_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 int fs_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi);
 int fs_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi);
 
+// --------------------------------------------------------
+// low-level callback declarations. Defined in lowlevel.cpp, they find
+// the paths of the inodes they are given and call the callbacks above.
+
+void ll_init(void *userdata, struct fuse_conn_info *conn);
+void ll_destroy(void *userdata);
+void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void ll_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup);
+void ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	struct fuse_file_info *fi);
+void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+void ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+	fuse_ino_t newparent, const char *newname, unsigned int flags);
+void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+void ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+	struct fuse_file_info *fi);
+void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+	struct fuse_file_info *fi);
+void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void ll_statfs(fuse_req_t req, fuse_ino_t ino);
+void ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value,
+	size_t size, int flags);
+void ll_access(fuse_req_t req, fuse_ino_t ino, int mask);
+
 // Declare a struct that will be used for fuse initialization
-static struct fuse_operations fs_oper;
+static struct fuse_lowlevel_ops fs_oper;
 
 // Fill-in the fuse initialization struct with all the required fuse callbacks
-static __attribute__ ((unused)) fuse_operations& fs_oper_init()
+static __attribute__ ((unused)) fuse_lowlevel_ops& fs_oper_init()
 {
-	fs_oper.getattr = fs_getattr;
-	//fs_oper.readlink = fs_readlink;
-	// no .getdir -- that's deprecated
-	//fs_oper.getdir = NULL;
-	fs_oper.mknod = fs_mknod;
-	fs_oper.mkdir = fs_mkdir;
-	fs_oper.unlink = fs_unlink;
-	fs_oper.rmdir = fs_rmdir;
-	//fs_oper.symlink = fs_symlink;
-	fs_oper.rename = fs_rename;
-	//fs_oper.link = fs_link;
-	//fs_oper.chmod = fs_chmod;
-	//fs_oper.chown = fs_chown;
-	fs_oper.truncate = fs_truncate;
-	fs_oper.utime = fs_utime;
-	fs_oper.open = fs_open;
-	fs_oper.read = fs_read;
-	fs_oper.write = fs_write;
+	fs_oper.init = ll_init;
+	fs_oper.destroy = ll_destroy;
+	fs_oper.lookup = ll_lookup;
+	fs_oper.forget = ll_forget;
+	fs_oper.forget_multi = ll_forget_multi;
+	fs_oper.getattr = ll_getattr;
+	fs_oper.setattr = ll_setattr;
+	fs_oper.mknod = ll_mknod;
+	fs_oper.mkdir = ll_mkdir;
+	fs_oper.unlink = ll_unlink;
+	fs_oper.rmdir = ll_rmdir;
+	fs_oper.rename = ll_rename;
+	fs_oper.open = ll_open;
+	fs_oper.read = ll_read;
+	fs_oper.write = ll_write;
+	fs_oper.write_buf = ll_write_buf;
 
 	// ------------------------------
 
-	fs_oper.statfs = fs_statfs;
-	fs_oper.flush = fs_flush;
-	fs_oper.release = fs_release;
-	//fs_oper.fsync = fs_fsync;
-
-	//fs_oper.setxattr = fs_setxattr;
-	//fs_oper.getxattr = fs_getxattr;
-	//fs_oper.listxattr = fs_listxattr;
-	//fs_oper.removexattr = fs_removexattr;
-
-	fs_oper.opendir = fs_opendir;
-	fs_oper.readdir = fs_readdir;
-	fs_oper.releasedir = fs_releasedir;
-	//fs_oper.fsyncdir = fs_fsyncdir;
-	fs_oper.init = fs_init;
-	fs_oper.destroy = fs_destroy;
-	fs_oper.access = fs_access;
-	//fs_oper.create = fs_create;
-	//fs_oper.ftruncate = fs_ftruncate;
-	//fs_oper.fgetattr = fs_fgetattr;
+	fs_oper.statfs = ll_statfs;
+	fs_oper.flush = ll_flush;
+	fs_oper.release = ll_release;
+	fs_oper.fsync = ll_fsync;
+
+	fs_oper.setxattr = ll_setxattr;
+
+	fs_oper.opendir = ll_opendir;
+	fs_oper.readdir = ll_readdir;
+	fs_oper.releasedir = ll_releasedir;
+	fs_oper.access = ll_access;
 	return fs_oper;
 }
 
@@ -55,6 +55,29 @@ int fs_usage(const char* programname)
 	printf("\t--log <file>\t\tuse log file <file>\n");
 	printf("\t--verbose\t\tenable verbose logging\n");
 	printf("\t--disable-reload\tno reloading files on the fly\n");
+	printf("\t--snapshot <ms>\t\tread all tables of a directory listing\n");
+	printf("\t\t\t\tfrom one snapshot, held for <ms> milliseconds\n");
+	printf("\t--diff <line|set|key>\tcompare the lines of edited files in\n");
+	printf("\t\t\t\torder (line), their rows in any order (set)\n");
+	printf("\t\t\t\tor their rows in primary key order (key)\n");
+	printf("\t--stage\t\t\tapply large edits on the server through\n");
+	printf("\t\t\t\ta staging table\n");
+	printf("\t--upsert\t\tapply new and changed rows of tables with a\n");
+	printf("\t\t\t\tprimary key as upserts\n");
+	printf("\t--merge\t\t\tmerge written files with the changes that\n");
+	printf("\t\t\t\tother clients made since they were read\n");
+	printf("\t--private\t\tgive each writer of a file that is open a\n");
+	printf("\t\t\t\tprivate copy, merged when it is closed\n");
+	printf("\t--parallel <n>\t\tapply large commits on <n> connections\n");
+	printf("\t--lock-wait <s>\t\twait <s> seconds for a row lock on those\n");
+	printf("\t\t\t\tconnections (default: 2)\n");
+	printf("\t--async\t\t\tcommit closed files in the background\n");
+	printf("\t--coalesce <ms>\t\tcommit closed files in the background, once\n");
+	printf("\t\t\t\tnot released for <ms> milliseconds\n");
+	printf("\t--journal <dir>\t\tsave written files in <dir> until committed,\n");
+	printf("\t\t\t\tand commit those left by a crash on mount\n");
+	printf("\t--timeout <s>\t\tlet the kernel cache names and attributes\n");
+	printf("\t\t\t\tfor <s> seconds (default: 1)\n");
 	printf(" \nvalid mount-options are:\n");
 	printf(" \t-o opt\twhere opt is a valid mount option\n");
 	printf("see also: `man mount' for a full list of the mount options\n");
@@ -68,6 +91,18 @@ char tmpn[512];
 const char* logname = "/dev/null";
 int verbose = 0;
 int reload = 1;
+int snapshot = 0;
+int diffmode = DIFF_LINE;
+int stage = 0;
+int upsert = 0;
+int merge = 0;
+int priv = 0;
+int parallel = 0;
+int lockwait = 2;
+int async = 0;
+int coalesce = 0;
+const char* journal = NULL;
+double timeout = 1.0;
 
 int main(int argc, char *argv[])
 {
@@ -86,9 +121,33 @@ int main(int argc, char *argv[])
 		if(!strcmp(argv[argstart+1], "--root")) { enable_root = 1; argstart++; nextarg=1; }
 		else if(!strcmp(argv[argstart+1], "--verbose")) { verbose = 1; argstart++; nextarg=1; }
 		else if(!strcmp(argv[argstart+1], "--disable-reload")) { reload = 0; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--stage")) { stage = 1; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--upsert")) { upsert = 1; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--merge")) { merge = 1; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--private")) { priv = 1; merge = 1; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--async")) { async = 1; argstart++; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--parallel") && argstart+2 < argc)
+			{ parallel=atoi(argv[argstart+2]); argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--lock-wait") && argstart+2 < argc)
+			{ lockwait=atoi(argv[argstart+2]); argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--coalesce") && argstart+2 < argc)
+			{ coalesce=atoi(argv[argstart+2]); async = 1; argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--timeout") && argstart+2 < argc)
+			{ timeout=atof(argv[argstart+2]); argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--journal") && argstart+2 < argc)
+			{ journal=argv[argstart+2]; argstart+=2; nextarg=1; }
 		else if(!strcmp(argv[argstart+1], "--help")) argc=1;
 		else if(!strcmp(argv[argstart+1], "--log") && argstart+2 < argc)
 			{ logname=argv[argstart+2]; argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--snapshot") && argstart+2 < argc)
+			{ snapshot=atoi(argv[argstart+2]); argstart+=2; nextarg=1; }
+		else if(!strcmp(argv[argstart+1], "--diff") && argstart+2 < argc) {
+			if(!strcmp(argv[argstart+2], "line")) diffmode = DIFF_LINE;
+			else if(!strcmp(argv[argstart+2], "set")) diffmode = DIFF_SET;
+			else if(!strcmp(argv[argstart+2], "key")) diffmode = DIFF_KEY;
+			else argc=1;
+			argstart+=2; nextarg=1;
+		}
 	}
 
 	/* do not run as root */
@@ -120,19 +179,47 @@ int main(int argc, char *argv[])
 		{ std::cerr << "error: cannot change directory to " << cfg_dir << std::endl; return 1; }
 
 	retranse::node* nc = retranse::compile("config.ret");
+	// the write-back worker has its own copy of the configuration
+	retranse::node* wnc = async ? retranse::compile("config.ret") : NULL;
+	// and so has each connection of the pool
+	std::vector<retranse::node*> pnc;
+	bool pool_ok = true;
+	for(int k = 0; k < parallel; k++) {
+		pnc.push_back(retranse::compile("config.ret"));
+		pool_ok = pool_ok && pnc.back();
+	}
 
 	// restore current directory
 	if(chdir(curdir))
 		{ std::cerr << "error: cannot change directory to " << curdir << std::endl; return 1; }
 
-	if(!nc) {
+	if(!nc || (async && !wnc) || !pool_ok) {
 		std::cerr << "error in configuration file" << cfg_file << std::endl;
 		return 1;
 	}
 
 	fs_data = new fs_state();
+	fs_private = fs_data;
 	fs_data->verbose = verbose;
 	fs_data->reload = reload;
+	fs_data->snapshot = snapshot;
+	fs_data->diffmode = diffmode;
+	fs_data->stage = stage;
+	fs_data->merge = merge;
+	fs_data->priv = priv;
+	fs_data->async = async;
+	fs_data->coalesce = coalesce;
+	fs_data->lockwait = lockwait;
+	fs_data->timeout = timeout;
+	if(journal) {
+		// the journal is found by absolute path once fuse runs
+		mkdir(journal, 0700);
+		fs_data->journal = realpath(journal, NULL);
+		if(!fs_data->journal) {
+			std::cerr << "error: cannot open journal directory " << journal << std::endl;
+			return 1;
+		}
+	}
 	fs_data->logfile = log_open(logname);
 
 	// libfuse is able to do the rest of the command line parsing;
@@ -141,8 +228,14 @@ int main(int argc, char *argv[])
 
 	if ((argc - i) != 2) return fs_usage(argv[0]);
 
-	strcpy(tmpn, "/tmp/sql2textfs-XXXXXX");
+	// with the journal, the temporary directory is in the journal
+	// directory, so that its entries can link the baseline clones
+	if(fs_data->journal && strlen(fs_data->journal) + 16 < sizeof(tmpn))
+		sprintf(tmpn, "%s/.tmp-XXXXXX", fs_data->journal);
+	else
+		strcpy(tmpn, "/tmp/sql2textfs-XXXXXX");
 	fs_data->rootdir = mkdtemp(tmpn);
+	mkdir((std::string(fs_data->rootdir) + PRIVDIR).c_str(), 0700);
 	//std::cout << "Temp directory = " << fs_data->rootdir << std::endl;
 
 	try {
@@ -158,17 +251,73 @@ int main(int argc, char *argv[])
 
 		fs_data->h = new sql2text::handle(ci, sql, nc);
 		fs_data->h->check();
+		fs_data->sql = &sql;
+		fs_data->ci = &ci;
+		fs_data->nc = nc;
+		fs_data->stmts = new stmt_cache(&sql);
+		fs_data->stmts->upsert = upsert;
+
+		if(async) {
+			// the connection of the write-back worker
+			db_conn* w = new db_conn();
+			w->sql = new cppdb::session(ci);
+			w->nc = wnc;
+			w->h = new sql2text::handle(ci, *w->sql, wnc);
+			w->stmts = new stmt_cache(w->sql);
+			w->stmts->upsert = upsert;
+			fs_data->wdb = w;
+		}
+
+		// i is still the index of the connection string, which is
+		// removed from the arguments below
+		for(int k = 0; k < parallel; k++) {
+			// a connection of the pool
+			db_conn* p = new db_conn();
+			p->sql = new cppdb::session(ci);
+			p->nc = pnc[k];
+			p->h = new sql2text::handle(ci, *p->sql, pnc[k]);
+			p->stmts = new stmt_cache(p->sql);
+			p->stmts->upsert = upsert;
+			fs_data->pool.push_back(p);
+		}
 
 		pthread_mutex_init(&(fs_data->lock), NULL);
+		pthread_mutex_init(&(fs_data->plock), NULL);
+		pthread_cond_init(&(fs_data->cjob), NULL);
+		pthread_cond_init(&(fs_data->cdone), NULL);
 
 
 		argv[argstart] = argv[0];
 		argv[i] = argv[i+1];
 		argc--;
 
-		//fprintf(stderr, "about to call fuse_main\n");
-		fuse_stat = fuse_main(argc-argstart, argv+argstart, &(fs_oper_init()), fs_data);
-		fprintf(stderr, "%s: fuse_main returned %d\n", argv[0], fuse_stat);
+		// libfuse parses the mount point and the mount options, and
+		// the session serves the kernel, on many threads unless -s is
+		// given, until it is unmounted
+		struct fuse_args args = FUSE_ARGS_INIT(argc-argstart, argv+argstart);
+		struct fuse_cmdline_opts opts;
+		if(fuse_parse_cmdline(&args, &opts) || !opts.mountpoint)
+			return fs_usage(argv[0]);
+
+		fuse_stat = 1;
+		struct fuse_session* se = fuse_session_new(&args, &(fs_oper_init()),
+			sizeof(fs_oper), fs_data);
+		fs_data->se = se;
+		if(se) {
+			if(!fuse_set_signal_handlers(se)) {
+				if(!fuse_session_mount(se, opts.mountpoint)) {
+					fuse_daemonize(opts.foreground);
+					fuse_stat = opts.singlethread ? fuse_session_loop(se)
+						: fuse_session_loop_mt(se, opts.clone_fd);
+					fuse_session_unmount(se);
+				}
+				fuse_remove_signal_handlers(se);
+			}
+			fuse_session_destroy(se);
+		}
+		free(opts.mountpoint);
+		fuse_opt_free_args(&args);
+		fprintf(stderr, "%s: fuse session returned %d\n", argv[0], fuse_stat);
 		rmdir(fs_data->rootdir);
 
 		return fuse_stat;
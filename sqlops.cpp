@@ -0,0 +1,122 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+
+std::vector<std::string> rt_call(const char* fn, const std::vector<std::string>& args)
+{
+	fs_state* b = FS_DATA;
+	db_conn* db = FS_DB;
+
+	std::vector<std::string> a, r;
+	a.push_back(b->ci->driver);
+	a.insert(a.end(), args.begin(), args.end());
+	retranse::run(db->nc, fn, a, r);
+	return r;
+}
+
+unsigned long long rt_exec(const char* fn, const std::vector<std::string>& args)
+{
+	db_conn* db = FS_DB;
+
+	std::vector<std::string> q = rt_call(fn, args);
+	if(q.empty() || q[0].empty()) return 0;
+
+	log_vmsg("+ rt_exec %s: %s\n", fn, q[0].c_str());
+	cppdb::statement st = db->sql->create_statement(q[0]);
+	for(size_t i = 1; i < q.size(); i++)
+		st.bind(q[i]);
+	st.exec();
+	return st.affected();
+}
+
+std::string rt_value(const char* fn, const std::vector<std::string>& args)
+{
+	db_conn* db = FS_DB;
+
+	std::vector<std::string> q = rt_call(fn, args);
+	if(q.empty() || q[0].empty()) return "";
+
+	log_vmsg("+ rt_value %s: %s\n", fn, q[0].c_str());
+	cppdb::statement st = db->sql->create_statement(q[0]);
+	for(size_t i = 1; i < q.size(); i++)
+		st.bind(q[i]);
+	cppdb::result r = st.query();
+	std::string v;
+	if(r.next()) r.fetch(0, v);
+	return v;
+}
+
+// Milliseconds elapsed since time t
+static long elapsed_ms(const struct timeval& t)
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - t.tv_sec) * 1000L + (now.tv_usec - t.tv_usec) / 1000L;
+}
+
+// Start a snapshot transaction, unless one is already held
+// and its window has not expired yet.
+void snap_begin()
+{
+	fs_state* b = FS_DATA;
+	if(!b->snapshot) return;
+
+	snap_check();
+	if(b->snap_active) return;
+
+	try {
+		rt_exec("snap_begin");
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ snap_begin config: %s\n", e.s.c_str()); return; }
+	catch(std::exception& e)
+		{ log_vmsg("+ snap_begin cppdb: %s\n", e.what()); return; }
+
+	b->snap_active = 1;
+	gettimeofday(&b->snap_time, NULL);
+	log_msg("+ snap_begin: snapshot taken\n");
+}
+
+// End the snapshot transaction if its window has expired
+void snap_check()
+{
+	fs_state* b = FS_DATA;
+	if(b->snap_active && elapsed_ms(b->snap_time) >= b->snapshot)
+		snap_end();
+}
+
+// End the snapshot transaction. Called when the window expires
+// and before every write to the database.
+void snap_end()
+{
+	fs_state* b = FS_DATA;
+	if(!b->snap_active) return;
+
+	b->snap_active = 0;
+	try {
+		rt_exec("snap_end");
+	}
+	catch(retranse::rtex& e)
+		{ log_vmsg("+ snap_end config: %s\n", e.s.c_str()); return; }
+	catch(std::exception& e)
+		{ log_vmsg("+ snap_end cppdb: %s\n", e.what()); return; }
+
+	log_msg("+ snap_end: snapshot released\n");
+}
@@ -0,0 +1,53 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef SQLOPS_INCLUDED
+#define SQLOPS_INCLUDED
+
+#include <string>
+#include <vector>
+
+// Database operations of sql2textfs that are not part of the
+// libsql2text interface. The queries are generated by functions of
+// the retranse configuration, same as for libsql2text, and are run
+// on the session of the mounted database.
+
+// Call a function of the retranse configuration. The engine name is
+// passed as the first argument, followed by `args'.
+// Returns the reduced result: the query followed by its parameters.
+std::vector<std::string> rt_call(const char* fn,
+	const std::vector<std::string>& args = std::vector<std::string>());
+
+// Run the query generated by the retranse function `fn'.
+// Returns the number of rows affected.
+unsigned long long rt_exec(const char* fn,
+	const std::vector<std::string>& args = std::vector<std::string>());
+
+// Run the query generated by the retranse function `fn'.
+// Returns the first column of its first row, or an empty string.
+std::string rt_value(const char* fn,
+	const std::vector<std::string>& args = std::vector<std::string>());
+
+// Consistent snapshot of the database, shared by all the table dumps
+// of a directory traversal and held for the snapshot window.
+void snap_begin();
+void snap_check();
+void snap_end();
+
+#endif
@@ -0,0 +1,136 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+// Tests of the baseline clones: a table file open by a shared appender
+// and a private copy open by another appender, each committing its
+// appends to its own clone, must leave the baseline of the other one and
+// of a journal entry as they were.
+
+#include "../clone.cpp"
+#include <stdio.h>
+#include <string.h>
+#include <fstream>
+#include <sstream>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if(ok) return;
+	fprintf(stderr, "FAIL: %s\n", what);
+	failures++;
+}
+
+static std::string dir;
+
+static std::string path(const char* name)
+{
+	return dir + "/" + name;
+}
+
+static std::string read_file(const std::string& f)
+{
+	std::ifstream is(f.c_str());
+	std::stringstream ss;
+	ss << is.rdbuf();
+	return ss.str();
+}
+
+static void write_file(const std::string& f, const std::string& s, bool app)
+{
+	std::ofstream os(f.c_str(), app ? std::ios::app : std::ios::trunc);
+	os << s;
+}
+
+static ino_t inode(const std::string& f)
+{
+	struct stat st;
+	return stat(f.c_str(), &st) ? 0 : st.st_ino;
+}
+
+// Append s to file f, and commit the append to its clone as commit_append
+// does
+static void append(const std::string& f, const std::string& s)
+{
+	off_t base = read_file(f).size();
+	write_file(f, s, true);
+	check(clone_append(f.c_str(), (f + ".o").c_str(), base, base + s.size(),
+		dir.c_str()), "clone_append");
+}
+
+static void test_appenders()
+{
+	const std::string base = "id(i)!\tname(v8)\n1\ta\n2\tb\n";
+	std::string tab = path("tab"), copy = path("copy");
+
+	// the table file and its clone, as read from the database
+	write_file(tab, base, false);
+	check(clone_copy(tab.c_str(), (tab + ".o").c_str(), dir.c_str()), "clone_copy tab");
+
+	// a private copy and its own clone, as made by copy_open
+	write_file(copy, read_file(tab + ".o"), false);
+	check(clone_copy((tab + ".o").c_str(), (copy + ".o").c_str(), dir.c_str()),
+		"clone_copy copy");
+	check(inode(tab + ".o") != inode(copy + ".o"), "private clone is not linked");
+
+	// the shared appender appends in place: nothing else links its clone
+	ino_t ino = inode(tab + ".o");
+	append(tab, "3\tc\n");
+	check(inode(tab + ".o") == ino, "shared clone appended in place");
+	check(read_file(tab + ".o") == base + "3\tc\n", "shared clone appended");
+	check(read_file(copy + ".o") == base, "private clone unchanged by shared append");
+
+	// the private appender commits its own rows
+	append(copy, "4\td\n");
+	check(read_file(copy + ".o") == base + "4\td\n", "private clone appended");
+	check(read_file(tab + ".o") == base + "3\tc\n", "shared clone unchanged by private append");
+
+	// a journal entry links the shared clone: the next append writes a
+	// new clone and leaves the linked one as it was
+	std::string entry = path("entry.o");
+	check(!link((tab + ".o").c_str(), entry.c_str()), "link entry");
+	append(tab, "5\te\n");
+	check(inode(tab + ".o") != inode(entry), "linked clone replaced");
+	check(read_file(tab + ".o") == base + "3\tc\n5\te\n", "linked clone appended");
+	check(read_file(entry) == base + "3\tc\n", "journal baseline unchanged");
+
+	unlink(tab.c_str());
+	unlink((tab + ".o").c_str());
+	unlink(copy.c_str());
+	unlink((copy + ".o").c_str());
+	unlink(entry.c_str());
+}
+
+int main()
+{
+	char d[] = "/tmp/clone_test-XXXXXX";
+	if(!mkdtemp(d)) {
+		fprintf(stderr, "clone_test: mkdtemp failed\n");
+		return 1;
+	}
+	dir = d;
+	test_appenders();
+	rmdir(d);
+	if(failures) {
+		fprintf(stderr, "clone_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("clone_test: ok\n");
+	return 0;
+}
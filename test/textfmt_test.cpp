@@ -0,0 +1,310 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+// Tests of the text format encoder and tokenizer. The textfmt source is
+// included, so that each of its vectorized paths can be compared with
+// the scalar one whatever the cpu would select.
+
+#include "../textfmt.cpp"
+#include <stdlib.h>
+
+static int failures = 0;
+
+static void check(bool ok, const char* what, size_t n)
+{
+	if(ok) return;
+	fprintf(stderr, "FAIL: %s (%lu bytes)\n", what, (unsigned long) n);
+	failures++;
+}
+
+// Reference encoder, byte by byte as described in doc/FORMAT
+static std::string ref_escape(const std::string& s)
+{
+	std::string out;
+	for(size_t i = 0; i < s.size(); i++) {
+		unsigned char c = s[i];
+		if(c == '\\') out += "\\\\";
+		else if(c == '\t') out += "\\t";
+		else if(c == '\n') out += "\\n";
+		else if(c == '\r') out += "\\r";
+		else if(c < 0x20) {
+			char code[8];
+			sprintf(code, "\\{%d}", c);
+			out += code;
+		}
+		else out += c;
+	}
+	return out;
+}
+
+// Encode s with every path supported by the cpu and compare with the
+// reference. The input is encoded at an odd offset too, so that the
+// unaligned loads are exercised.
+static void check_escape(const std::string& s)
+{
+	std::string want = ref_escape(s);
+	std::string buf = "x" + s;
+	const char* p[2] = { s.data(), buf.data() + 1 };
+	int level = simd_level();
+
+	for(int k = 0; k < 2; k++) {
+		std::string out;
+		fmt_escape_scalar(p[k], s.size(), out);
+		check(out == want, "fmt_escape_scalar", s.size());
+#ifdef TEXTFMT_SIMD
+		if(level >= 1) {
+			out.clear();
+			fmt_escape_sse2(p[k], s.size(), out);
+			check(out == want, "fmt_escape_sse2", s.size());
+		}
+		if(level >= 2) {
+			out.clear();
+			fmt_escape_avx2(p[k], s.size(), out);
+			check(out == want, "fmt_escape_avx2", s.size());
+		}
+#endif
+		out = "prefix";
+		fmt_escape(p[k], s.size(), out);
+		check(out == "prefix" + want, "fmt_escape", s.size());
+	}
+	(void) level;
+}
+
+// Edge cases: empty input, every byte value alone, and special bytes
+// at each position around the 16 and 32 byte blocks
+static void test_escape_edges()
+{
+	check_escape(std::string());
+	for(int c = 0; c < 256; c++)
+		check_escape(std::string(1, (char) c));
+
+	const char sp[] = { '\\', '\t', '\n', '\r', 0, 0x1f, 0x20, 0x7f, (char) 0x80, (char) 0xff };
+	for(size_t n = 1; n <= 70; n++)
+		for(size_t i = 0; i < n; i++)
+			for(size_t k = 0; k < sizeof(sp); k++) {
+				std::string s(n, 'a');
+				s[i] = sp[k];
+				check_escape(s);
+			}
+	check_escape(std::string(100, '\\'));
+	check_escape(std::string(100, '\n'));
+}
+
+// Random input of random sizes, with mostly plain bytes
+static void test_escape_random()
+{
+	srand(1);
+	for(int t = 0; t < 20000; t++) {
+		std::string s(rand() % 300, 0);
+		for(size_t i = 0; i < s.size(); i++)
+			s[i] = rand() % 8 ? 'a' + rand() % 26 : (char) (rand() % 256);
+		check_escape(s);
+	}
+}
+
+// A field of the reference parser: its null flag and unescaped value
+typedef std::pair<bool, std::string> ref_field;
+typedef std::vector<ref_field> ref_row;
+
+// Reference parser of a single line without its new line, escape by
+// escape as described in doc/FORMAT
+static ref_row ref_parse_line(const std::string& l)
+{
+	ref_row r;
+	std::string v;
+	size_t fs = 0;
+	for(size_t i = 0; i <= l.size(); i++) {
+		if(i == l.size() || l[i] == '\t') {
+			bool null = l.compare(fs, i - fs, "\\N") == 0;
+			r.push_back(ref_field(null, null ? std::string() : v));
+			v.clear();
+			fs = i + 1;
+			continue;
+		}
+		if(l[i] != '\\') { v += l[i]; continue; }
+		if(++i == l.size()) { i--; continue; }
+		char c = l[i];
+		if(c == 't') v += '\t';
+		else if(c == 'n') v += '\n';
+		else if(c == 'r') v += '\r';
+		else if(c == '{') {
+			size_t j = i + 1;
+			int n = 0;
+			while(j < l.size() && isdigit(l[j])) n = n * 10 + (l[j++] - '0');
+			if(j < l.size() && l[j] == '}' && j > i + 1) { v += (char) n; i = j; }
+			else v += c;
+		}
+		else v += c;
+	}
+	return r;
+}
+
+// Reference parser of the lines of s. A last line without a new line is
+// parsed if `last'.
+static void ref_parse(const std::string& s, bool last, std::vector<std::string>& lines,
+	std::vector<ref_row>& rows)
+{
+	size_t p = 0;
+	while(p < s.size()) {
+		size_t q = s.find('\n', p);
+		if(q == std::string::npos) {
+			if(!last) break;
+			q = s.size();
+		}
+		lines.push_back(s.substr(p, q - p));
+		rows.push_back(ref_parse_line(lines.back()));
+		p = q + 1;
+	}
+}
+
+// Compare row r of a parsed batch, whose text is at s, with a reference row
+static bool same_row(const fmt_rows& out, const char* s, size_t r,
+	const std::string& line, const ref_row& want)
+{
+	if(std::string(s + out.rows[r].line, out.rows[r].len) != line) return false;
+	if(out.fields(r) != want.size()) return false;
+	for(size_t i = 0; i < want.size(); i++) {
+		size_t f = out.rows[r].first + i;
+		if(out.null(f) != want[i].first || out.field(f) != want[i].second)
+			return false;
+	}
+	return true;
+}
+
+// Random text in the sql2text format, with escapes that are valid,
+// incomplete or unknown, NULL fields and empty lines
+static std::string random_text(size_t n)
+{
+	static const char* parts[] = { "a", "bc", "\t", "\n", "\\", "\\t", "\\n",
+		"\\r", "\\N", "\\\\", "\\x", "\\{7}", "\\{255}", "\\{}", "\\{12",
+		"{3}", "N", "\\\n", "\\\t" };
+	const size_t np = sizeof(parts) / sizeof(parts[0]);
+	std::string s;
+	while(s.size() < n) {
+		int k = rand() % 4;
+		if(k == 0) s += std::string(rand() % 40, 'a' + rand() % 26);
+		else s += parts[rand() % np];
+	}
+	return s;
+}
+
+// Check every tokenizer scan supported by the cpu against the scalar one
+static void check_special(const std::string& s)
+{
+	int level = simd_level();
+	for(size_t i = 0; i <= s.size(); i += 1 + i / 8) {
+		size_t want = find_special_scalar(s.data(), i, s.size());
+#ifdef TEXTFMT_SIMD
+		if(level >= 1)
+			check(find_special_sse2(s.data(), i, s.size()) == want,
+				"find_special_sse2", s.size());
+		if(level >= 2)
+			check(find_special_avx2(s.data(), i, s.size()) == want,
+				"find_special_avx2", s.size());
+#endif
+	}
+	(void) level;
+}
+
+// fmt_parse against the reference parser
+static void check_parse(const std::string& s)
+{
+	std::vector<std::string> lines;
+	std::vector<ref_row> want;
+	ref_parse(s, false, lines, want);
+
+	fmt_rows out;
+	size_t used = fmt_parse(s.data(), s.size(), out);
+	size_t e = s.rfind('\n');
+	check(used == (e == std::string::npos ? 0 : e + 1), "fmt_parse used", s.size());
+	check(out.rows.size() == want.size(), "fmt_parse rows", s.size());
+	for(size_t r = 0; r < out.rows.size() && r < want.size(); r++)
+		check(same_row(out, s.data(), r, lines[r], want[r]), "fmt_parse row", s.size());
+	check_special(s);
+}
+
+static void test_parse()
+{
+	check_parse("");
+	check_parse("a\tb\n");
+	check_parse("a\tb");
+	check_parse("\\N\t\\\\N\tN\t\\N \n");
+	check_parse("\\{0}\\{9}\\{31}\\{92}\t\\{\t\\{x}\t\\{1\n");
+	check_parse("\t\t\n\n");
+	check_parse("end\\\nnext\\\n");
+
+	srand(2);
+	for(int t = 0; t < 5000; t++)
+		check_parse(random_text(rand() % 500));
+}
+
+// fmt_reader on a file of a few blocks, with lines longer than a block
+// and lines across the block boundaries, read whole and from an offset
+static void test_reader()
+{
+	char fname[] = "/tmp/textfmt_test-XXXXXX";
+	int fd = mkstemp(fname);
+	if(fd < 0) { check(false, "mkstemp", 0); return; }
+
+	srand(3);
+	std::string s = "header\tline\n";
+	while(s.size() < 3 * FMT_READ_BLOCK + 12345) {
+		s += random_text(rand() % 2000);
+		if(s.size() > FMT_READ_BLOCK && s.size() < FMT_READ_BLOCK + 2000)
+			s += random_text(FMT_READ_BLOCK + 100);
+	}
+	// a last line without a new line
+	s += "last\\tline";
+	if(write(fd, s.data(), s.size()) != (ssize_t) s.size())
+		check(false, "write", s.size());
+	close(fd);
+
+	size_t from[2] = { 0, s.find('\n') + 1 };
+	for(int k = 0; k < 2; k++) {
+		std::vector<std::string> lines;
+		std::vector<ref_row> want;
+		ref_parse(s.substr(from[k]), true, lines, want);
+
+		fmt_reader rd(fname, from[k]);
+		fmt_rows out;
+		size_t n = 0;
+		bool ok = true;
+		while(rd.next(out))
+			for(size_t r = 0; r < out.rows.size(); r++, n++)
+				ok = ok && n < want.size()
+					&& same_row(out, rd.buf.data(), r, lines[n], want[n]);
+		check(ok && rd.good(), "fmt_reader rows", s.size());
+		check(n == want.size(), "fmt_reader row count", s.size());
+	}
+	unlink(fname);
+}
+
+int main()
+{
+	test_escape_edges();
+	test_escape_random();
+	test_parse();
+	test_reader();
+	if(failures) {
+		fprintf(stderr, "textfmt_test: %d failures\n", failures);
+		return 1;
+	}
+	printf("textfmt_test: ok (simd level %d)\n", simd_level());
+	return 0;
+}
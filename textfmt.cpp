@@ -0,0 +1,316 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "textfmt.hpp"
+
+// Size of a block read by fmt_reader
+#define FMT_READ_BLOCK (1 << 20)
+
+// The vectorized encoders are built for x86 with gcc or clang, and are
+// chosen at runtime according to the cpu. Other targets use only the
+// scalar encoder.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TEXTFMT_SIMD
+#include <immintrin.h>
+#endif
+
+// Append the escaped form of the single byte c, which needs escaping
+static void escape_byte(unsigned char c, std::string& out)
+{
+	char code[8];
+	switch(c) {
+	case '\\': out += "\\\\"; break;
+	case '\t': out += "\\t"; break;
+	case '\n': out += "\\n"; break;
+	case '\r': out += "\\r"; break;
+	default:
+		sprintf(code, "\\{%d}", c);
+		out += code;
+	}
+}
+
+// True if byte c needs escaping
+static inline bool needs_escape(unsigned char c)
+{
+	return c < 0x20 || c == '\\';
+}
+
+// Scalar encoder. Clean spans are copied in bulk.
+static void fmt_escape_scalar(const char* s, size_t n, std::string& out)
+{
+	size_t span = 0;
+	for(size_t i = 0; i < n; i++) {
+		if(!needs_escape(s[i])) continue;
+		out.append(s + span, i - span);
+		escape_byte(s[i], out);
+		span = i + 1;
+	}
+	out.append(s + span, n - span);
+}
+
+#ifdef TEXTFMT_SIMD
+
+// SSE2 encoder. Scans 16 bytes at a time: a byte needs escaping if it
+// is a `\' or if max(byte, 0x1f) == 0x1f, which is an unsigned compare.
+__attribute__ ((target("sse2")))
+static void fmt_escape_sse2(const char* s, size_t n, std::string& out)
+{
+	const __m128i bs = _mm_set1_epi8('\\');
+	const __m128i ct = _mm_set1_epi8(0x1f);
+	size_t i = 0, span = 0;
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (s + i));
+		unsigned m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(x, bs),
+			_mm_cmpeq_epi8(_mm_max_epu8(x, ct), ct)));
+		while(m) {
+			size_t j = i + __builtin_ctz(m);
+			out.append(s + span, j - span);
+			escape_byte(s[j], out);
+			span = j + 1;
+			m &= m - 1;
+		}
+	}
+	out.append(s + span, i - span);
+	fmt_escape_scalar(s + i, n - i, out);
+}
+
+// AVX2 encoder, same as the SSE2 one on 32 bytes at a time
+__attribute__ ((target("avx2")))
+static void fmt_escape_avx2(const char* s, size_t n, std::string& out)
+{
+	const __m256i bs = _mm256_set1_epi8('\\');
+	const __m256i ct = _mm256_set1_epi8(0x1f);
+	size_t i = 0, span = 0;
+
+	for(; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (s + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_or_si256(
+			_mm256_cmpeq_epi8(x, bs),
+			_mm256_cmpeq_epi8(_mm256_max_epu8(x, ct), ct)));
+		while(m) {
+			size_t j = i + __builtin_ctz(m);
+			out.append(s + span, j - span);
+			escape_byte(s[j], out);
+			span = j + 1;
+			m &= m - 1;
+		}
+	}
+	out.append(s + span, i - span);
+	fmt_escape_sse2(s + i, n - i, out);
+}
+
+#endif
+
+// Position of the first tab, new line or `\' at or after i, or n
+static size_t find_special_scalar(const char* s, size_t i, size_t n)
+{
+	for(; i < n; i++)
+		if(s[i] == '\t' || s[i] == '\n' || s[i] == '\\') break;
+	return i;
+}
+
+#ifdef TEXTFMT_SIMD
+
+__attribute__ ((target("sse2")))
+static size_t find_special_sse2(const char* s, size_t i, size_t n)
+{
+	const __m128i tb = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i bs = _mm_set1_epi8('\\');
+
+	for(; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i*) (s + i));
+		unsigned m = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+			_mm_cmpeq_epi8(x, tb), _mm_cmpeq_epi8(x, nl)),
+			_mm_cmpeq_epi8(x, bs)));
+		if(m) return i + __builtin_ctz(m);
+	}
+	return find_special_scalar(s, i, n);
+}
+
+__attribute__ ((target("avx2")))
+static size_t find_special_avx2(const char* s, size_t i, size_t n)
+{
+	const __m256i tb = _mm256_set1_epi8('\t');
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i bs = _mm256_set1_epi8('\\');
+
+	for(; i + 32 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i*) (s + i));
+		unsigned m = _mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(
+			_mm256_cmpeq_epi8(x, tb), _mm256_cmpeq_epi8(x, nl)),
+			_mm256_cmpeq_epi8(x, bs)));
+		if(m) return i + __builtin_ctz(m);
+	}
+	return find_special_sse2(s, i, n);
+}
+
+#endif
+
+// The vectorized function level supported by the cpu:
+// 0: scalar only, 1: SSE2, 2: AVX2
+static int simd_level()
+{
+#ifdef TEXTFMT_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return 2;
+	if(__builtin_cpu_supports("sse2")) return 1;
+#endif
+	return 0;
+}
+
+typedef void (*escape_fn)(const char*, size_t, std::string&);
+typedef size_t (*special_fn)(const char*, size_t, size_t);
+
+// Select the best encoder supported by the cpu
+static escape_fn escape_select()
+{
+#ifdef TEXTFMT_SIMD
+	switch(simd_level()) {
+	case 2: return fmt_escape_avx2;
+	case 1: return fmt_escape_sse2;
+	}
+#endif
+	return fmt_escape_scalar;
+}
+
+// Select the best tokenizer scan supported by the cpu
+static special_fn special_select()
+{
+#ifdef TEXTFMT_SIMD
+	switch(simd_level()) {
+	case 2: return find_special_avx2;
+	case 1: return find_special_sse2;
+	}
+#endif
+	return find_special_scalar;
+}
+
+void fmt_escape(const char* s, size_t n, std::string& out)
+{
+	static escape_fn fn = escape_select();
+	fn(s, n, out);
+}
+
+// Decode the escape sequence that starts with the `\' at s[i], where
+// the line ends at e. Appends the decoded byte to out and returns the
+// position after the sequence.
+static size_t unescape_at(const char* s, size_t i, size_t e, std::string& out)
+{
+	if(++i >= e || s[i] == '\n') return i;	// a `\' at the end of the line
+	switch(s[i]) {
+	case 't': out += '\t'; return i + 1;
+	case 'n': out += '\n'; return i + 1;
+	case 'r': out += '\r'; return i + 1;
+	case '{': {
+		size_t j = i + 1;
+		int c = 0;
+		while(j < e && s[j] >= '0' && s[j] <= '9') c = c * 10 + (s[j++] - '0');
+		if(j < e && s[j] == '}' && j > i + 1) {
+			out += (char) c;
+			return j + 1;
+		}
+		break;
+	}
+	}
+	out += s[i];
+	return i + 1;
+}
+
+size_t fmt_parse(const char* s, size_t n, fmt_rows& out)
+{
+	static special_fn find = special_select();
+
+	// only complete lines are parsed
+	size_t e = n;
+	while(e && s[e-1] != '\n') e--;
+
+	size_t i = 0;
+	while(i < e) {
+		fmt_rows::row r;
+		r.line = i;
+		r.first = out.ends.size();
+		size_t fs = i;	// raw start of the current field
+		for(;;) {
+			size_t j = find(s, i, e);
+			out.data.append(s + i, j - i);
+			if(s[j] == '\\') { i = unescape_at(s, j, e, out.data); continue; }
+
+			// end of field, at a tab or a new line
+			bool null = (j - fs == 2 && s[fs] == '\\' && s[fs+1] == 'N');
+			if(null) out.data.resize(out.data.size() - 1);
+			out.ends.push_back(out.data.size());
+			out.nulls.push_back(null);
+			i = j + 1;
+			if(s[j] == '\n') break;
+			fs = i;
+		}
+		r.len = i - 1 - r.line;
+		out.rows.push_back(r);
+	}
+	return e;
+}
+
+fmt_reader::fmt_reader(const char* fname, off_t from, off_t to)
+	: fd(open(fname, O_RDONLY)), error(0), eof(false), used(0),
+	  left(to < 0 ? -1 : to - from)
+{
+	if(fd >= 0 && from && lseek(fd, from, SEEK_SET) < 0)
+		error = errno;
+}
+
+fmt_reader::~fmt_reader()
+{
+	if(fd >= 0) close(fd);
+}
+
+bool fmt_reader::next(fmt_rows& out)
+{
+	out.clear();
+	if(!good()) return false;
+
+	buf.erase(0, used);
+	used = 0;
+	for(;;) {
+		used = fmt_parse(buf.data(), buf.size(), out);
+		if(out.rows.size() || eof) return out.rows.size() != 0;
+
+		size_t n = buf.size();
+		size_t sz = FMT_READ_BLOCK;
+		if(left >= 0 && (off_t) sz > left) sz = left;
+		buf.resize(n + sz);
+		ssize_t r = 0;
+		if(sz) do r = read(fd, &buf[n], sz);
+		while(r < 0 && errno == EINTR);
+		buf.resize(n + (r > 0 ? r : 0));
+		if(r > 0 && left >= 0) left -= r;
+
+		if(r < 0) { error = errno; eof = true; buf.clear(); }
+		else if(r == 0) {
+			eof = true;
+			if(buf.size()) buf += '\n';
+		}
+	}
+}
@@ -0,0 +1,97 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef TEXTFMT_INCLUDED
+#define TEXTFMT_INCLUDED
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// Encoding of the sql2text text file format (see doc/FORMAT).
+
+// Append the escaped form of the n bytes of data at s to out.
+// `\', tab, new line and carriage return are written as \\, \t, \n
+// and \r, any other control character as \{<n>}.
+// Uses an SSE2 or AVX2 encoder when the cpu supports it.
+void fmt_escape(const char* s, size_t n, std::string& out);
+
+// Append the representation of a NULL entry to out
+inline void fmt_null(std::string& out) { out += "\\N"; }
+
+// A batch of rows parsed from text in the sql2text format.
+// The fields of all rows are stored unescaped, back to back, in data.
+struct fmt_rows {
+	// A single row: its raw line in the parsed text (without the
+	// new line) and the index of its first field
+	struct row {
+		size_t line;
+		size_t len;
+		size_t first;
+	};
+
+	std::string data;
+	std::vector<size_t> ends;
+	std::vector<char> nulls;
+	std::vector<row> rows;
+
+	void clear() { data.clear(); ends.clear(); nulls.clear(); rows.clear(); }
+	// number of fields of row r
+	size_t fields(size_t r) const
+		{ return (r + 1 < rows.size() ? rows[r+1].first : ends.size()) - rows[r].first; }
+	// start, length and null flag of field i of the batch
+	size_t start(size_t i) const { return i ? ends[i-1] : 0; }
+	size_t size(size_t i) const { return ends[i] - start(i); }
+	bool null(size_t i) const { return nulls[i]; }
+	std::string field(size_t i) const { return data.substr(start(i), size(i)); }
+};
+
+// Parse the complete lines of the n bytes at s, appending them to
+// `out'. Tabs, new lines and escapes are located with SSE2 or AVX2
+// when the cpu supports it. A field of exactly \N is NULL.
+// Returns the number of bytes parsed, up to and including the last
+// new line; the rest is an incomplete line.
+size_t fmt_parse(const char* s, size_t n, fmt_rows& out);
+
+// Reader of a file in the sql2text format. The file is read in large
+// blocks and parsed to batches of rows with fmt_parse. A last line
+// without a new line is also returned.
+// Optionally only the bytes from offset `from' up to offset `to' are
+// read, where `from' should be the start of a line.
+struct fmt_reader {
+	int fd;
+	int error;
+	bool eof;
+	std::string buf;
+	size_t used;
+	// bytes left to read, or -1 for up to the end of the file
+	off_t left;
+
+	explicit fmt_reader(const char* fname, off_t from = 0, off_t to = -1);
+	~fmt_reader();
+	bool good() const { return fd >= 0 && !error; }
+	// Parse the next batch of rows to out. Returns false at the end
+	// of the file or on error.
+	bool next(fmt_rows& out);
+	// The raw line of row r of the last batch
+	std::string line(const fmt_rows& rows, size_t r) const
+		{ return buf.substr(rows.rows[r].line, rows.rows[r].len); }
+};
+
+#endif
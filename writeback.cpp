@@ -0,0 +1,157 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#include "sql2textfs.hpp"
+#include "writeback.hpp"
+
+// The queued table file that is committed next, or end() if none.
+// Files that are open are skipped, unless the worker is stopping: they
+// are queued again on their release.
+static std::map<std::string, struct timeval>::iterator wb_next()
+{
+	fs_state* b = FS_DATA;
+	std::map<std::string, struct timeval>::iterator it, next = b->queued.end();
+	for(it = b->queued.begin(); it != b->queued.end(); ++it)
+		if((b->stop || !b->openfiles[it->first])
+			&& (next == b->queued.end() || timercmp(&it->second, &next->second, <)))
+			next = it;
+	return next;
+}
+
+// The worker thread
+static void* wb_run(void*)
+{
+	fs_state* b = FS_DATA;
+	fs_thread_db = b->wdb;
+
+	pthread_mutex_lock(&b->lock);
+	for(;;) {
+		std::map<std::string, struct timeval>::iterator it = wb_next();
+		if(it == b->queued.end()) {
+			if(b->stop) break;
+			pthread_cond_wait(&b->cjob, &b->lock);
+			continue;
+		}
+
+		// wait until the file is due, or until the queue changes
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		if(!b->stop && timercmp(&now, &it->second, <)) {
+			struct timespec ts;
+			ts.tv_sec = it->second.tv_sec;
+			ts.tv_nsec = it->second.tv_usec * 1000;
+			pthread_cond_timedwait(&b->cjob, &b->lock, &ts);
+			continue;
+		}
+
+		std::string path = it->first;
+		b->queued.erase(it);
+		b->running = path;
+		fs_file* f = &b->files[path];
+
+		// The table file is closed, and opening, truncating, removing
+		// or renaming it waits for this commit, so it is committed
+		// without the main mutex.
+		pthread_mutex_unlock(&b->lock);
+		log_msg("wb_run(path=\"%s\")\n", path.c_str());
+		fs_commit(path.c_str(), f);
+		pthread_mutex_lock(&b->lock);
+
+		b->running.clear();
+		pthread_cond_broadcast(&b->cdone);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+void wb_start()
+{
+	fs_state* b = FS_DATA;
+	if(!b->async) return;
+	b->stop = 0;
+	if(pthread_create(&b->worker, NULL, wb_run, NULL)) {
+		log_msg("    ERROR wb_start: cannot start the worker, committing synchronously\n");
+		b->async = 0;
+	}
+}
+
+void wb_stop()
+{
+	fs_state* b = FS_DATA;
+	if(!b->async) return;
+	b->stop = 1;
+	pthread_cond_signal(&b->cjob);
+	pthread_mutex_unlock(&b->lock);
+	pthread_join(b->worker, NULL);
+	pthread_mutex_lock(&b->lock);
+	b->async = 0;
+}
+
+void wb_queue(const char* path)
+{
+	fs_state* b = FS_DATA;
+	struct timeval& due = b->queued[path];
+	gettimeofday(&due, NULL);
+	due.tv_sec += b->coalesce / 1000;
+	due.tv_usec += (b->coalesce % 1000) * 1000;
+	if(due.tv_usec >= 1000000) { due.tv_sec++; due.tv_usec -= 1000000; }
+	pthread_cond_signal(&b->cjob);
+}
+
+bool wb_queued(const char* path)
+{
+	return FS_DATA->queued.count(path) != 0;
+}
+
+// True if `name' is table file `path', or is under directory `path'
+static bool wb_match(const std::string& name, const char* path, bool dir)
+{
+	if(!dir) return name == path;
+	size_t n = strlen(path);
+	return !name.compare(0, n, path) && name.size() > n && name[n] == '/';
+}
+
+void wb_wait(const char* path, bool dir)
+{
+	fs_state* b = FS_DATA;
+	while(!b->running.empty() && wb_match(b->running, path, dir))
+		pthread_cond_wait(&b->cdone, &b->lock);
+}
+
+bool wb_take(const char* path)
+{
+	wb_wait(path);
+	return FS_DATA->queued.erase(path) != 0;
+}
+
+int wb_flush(const char* path, bool dir)
+{
+	fs_state* b = FS_DATA;
+	int retstat = 0;
+	wb_wait(path, dir);
+
+	std::map<std::string, struct timeval>::iterator it = dir
+		? b->queued.lower_bound(std::string(path) + "/") : b->queued.find(path);
+	while(it != b->queued.end() && wb_match(it->first, path, dir)) {
+		std::string name = it->first;
+		b->queued.erase(it++);
+		if(fs_commit(name.c_str(), &b->files[name]) < 0) retstat = -1;
+	}
+	return retstat;
+}
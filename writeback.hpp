@@ -0,0 +1,57 @@
+/*  sql2textfs, a FUSE filesystem for mounting database tables as text files 
+ *  Copyright (C) 2013, Kimon Kontosis
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published
+ *  by the Free Software Foundation; either version 3.0, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  version 3.0 along with this program (see LICENSE); if not, see 
+ *  <http://www.gnu.org/licenses/>.
+ *
+*/
+
+#ifndef WRITEBACK_INCLUDED
+#define WRITEBACK_INCLUDED
+
+// Write-back of table files. With the async policy, the commit of a
+// released table file is queued to a worker thread, which commits it on
+// its own database connection, so that close() returns immediately.
+// A queued commit is due once the file has not been released for the
+// coalescing window, and the worker skips the files that are open, so
+// all the writes of a burst of open/write/close cycles are committed
+// together, as a single diff against the baseline clone. Operations
+// that would read, change or remove a table file first wait for its
+// running commit, and those that end its table also flush its queued
+// one. All functions are called with the main mutex locked.
+
+// Start and stop the worker. Stopping commits the queued files first.
+void wb_start();
+void wb_stop();
+
+// Queue the commit of table file `path', or delay it if already queued
+void wb_queue(const char* path);
+
+// True if a commit of table file `path' is queued
+bool wb_queued(const char* path);
+
+// Wait for the running commit of table file `path', or of any table
+// file under directory `path' if dir is true
+void wb_wait(const char* path, bool dir = false);
+
+// Wait for the running commit of table file `path' and remove its
+// queued commit from the queue. Returns true if it was queued.
+bool wb_take(const char* path);
+
+// Wait for the running commit of table file `path', or of any table
+// file under directory `path' if dir is true, and commit its queued
+// commits now. Returns 0, or -1 if a commit failed.
+int wb_flush(const char* path, bool dir = false);
+
+#endif